@@ -7,13 +7,33 @@
 #include <linux/atomic.h>
 #include <linux/bootmem.h>
 #include <linux/memblock.h>
+#include <linux/cpu.h>
+#include <linux/moduleparam.h>
+#include <linux/mempolicy.h>
+#include <linux/sort.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/node.h>
+#include <linux/mutex.h>
 #include "internal.h"
+#include "hpa_trace.h"
 
 struct hugepage *huge_mem_map;
+struct hugepage *hpa_memmap_start;
+struct hugepage *hpa_memmap_end;
+struct hpa_range hpa_ranges[HPA_MAX_RANGES];
+int hpa_nr_ranges;
+unsigned long *hpa_offline_map;
 struct hpa_node *hpa_node_data[MAX_NUMNODES];
 struct hpa_section *hpa_section_array[MAX_NUMNODES];
 
 EXPORT_SYMBOL(huge_mem_map);
+EXPORT_SYMBOL(hpa_memmap_start);
+EXPORT_SYMBOL(hpa_memmap_end);
+EXPORT_SYMBOL(hpa_ranges);
+EXPORT_SYMBOL(hpa_nr_ranges);
+EXPORT_SYMBOL(hpa_offline_map);
 EXPORT_SYMBOL(hpa_node_data);
 EXPORT_SYMBOL(hpa_section_array);
 /*start pfn and number of whole hugepages area*/
@@ -25,24 +45,394 @@ unsigned long hpa_node_end[MAX_NUMNODES];
 unsigned long hpnode_mask = 0UL;
 unsigned long total_page;
 unsigned long free_page;
+unsigned int hpa_section_shift = HPA_SECTION_SHIFT_DEFAULT;
 EXPORT_SYMBOL(hpa_start_pfn);
 EXPORT_SYMBOL(hpa_end_pfn);
 EXPORT_SYMBOL(hpa_nr_pages);
 EXPORT_SYMBOL(hpnode_mask);
 EXPORT_SYMBOL(total_page);
 EXPORT_SYMBOL(free_page);
+EXPORT_SYMBOL(hpa_section_shift);
 
 bool is_hpa_pfn(unsigned long pfn)
 {
-	return (pfn>=hpa_start_pfn && pfn<hpa_end_pfn);
+	return hpa_pfn_to_page(pfn) != NULL;
 }
 EXPORT_SYMBOL(is_hpa_pfn);
 bool is_hpa_page(struct page* page)
 {
 	struct hugepage* p=(struct hugepage*)page;
-	return ((p>=huge_mem_map) && (p<huge_mem_map+hpa_nr_pages));
+	struct hpa_range *r = hpa_page_range(p);
+
+	if (!r)
+		return false;
+	return !hpa_offline_map ||
+	       !test_bit(r->first + (p - r->mem_map), hpa_offline_map);
 }
 EXPORT_SYMBOL(is_hpa_page);
+
+/* /sys/kernel/debug/hpa, created by its first user; initcalls run serially */
+struct dentry *hpa_debugfs_root(void)
+{
+	static struct dentry *dir;
+
+	if (!dir)
+		dir = debugfs_create_dir("hpa", NULL);
+	return dir;
+}
+
+/* free pages of all nodes, including those sitting in pcp lists */
+unsigned long hpa_nr_free_pages(void)
+{
+	long nr = 0;
+	int nid;
+
+	for_each_huge_node(nid, HPNODE_MASK)
+		nr += hpa_node_page_state(HPA_NODE_DATA(nid), NR_FREE_PAGES);
+	return nr;
+}
+EXPORT_SYMBOL(hpa_nr_free_pages);
+
+/*
+ * Per-cpu free lists: a free goes to the local cpu's list of the page's
+ * node and an allocation takes from it, so most pairs never touch the
+ * section lists. pcp_high bounds the pages one cpu may cache per node,
+ * pcp_batch is how many pages are moved per refill or drain.
+ */
+static int hpa_pcp_high = 16;
+static int hpa_pcp_batch = 4;
+module_param_named(pcp_high, hpa_pcp_high, int, 0644);
+module_param_named(pcp_batch, hpa_pcp_batch, int, 0644);
+
+static inline int hpa_pcp_get_batch(void)
+{
+	int high = ACCESS_ONCE(hpa_pcp_high);
+	int batch = ACCESS_ONCE(hpa_pcp_batch);
+
+	if (batch > high)
+		batch = high;
+	return batch < 1 ? 1 : batch;
+}
+
+static inline unsigned long hpa_section_nr(int nid, struct hpa_section *section)
+{
+    return section - hpa_section_array[nid];
+}
+
+/* index of page within section, for free_map */
+static inline unsigned long hpa_section_page_idx(struct hpa_section *section,
+                                                 struct hugepage *page)
+{
+    return (hpa_page_to_pfn(page) - section->start_pfn) >> 9;
+}
+
+/*
+ * section->max_run bounds the longest run of free pages from above, so
+ * hpa_alloc_contig_pages skips sections that cannot fit a request without
+ * looking at their bitmap. Allocations only shorten runs and leave it
+ * alone; a free grows it to the run the page joins, found a word at a
+ * time. A failed search stores the exact value. Caller holds
+ * section->lock.
+ */
+static void hpa_section_note_free(struct hpa_section *section, unsigned long idx)
+{
+    unsigned long *map = section->free_map;
+    unsigned long w = idx / BITS_PER_LONG, start, end, x;
+
+    if (section->nr_free <= section->max_run)
+        return;
+
+    x = ~map[w] & ((1UL << (idx % BITS_PER_LONG)) - 1);
+    while (!x && w)
+        x = ~map[--w];
+    start = x ? w * BITS_PER_LONG + __fls(x) + 1 : 0;
+    end = find_next_zero_bit(map, section->nr_pages, idx);
+    if (end - start > section->max_run)
+        section->max_run = end - start;
+}
+
+/* the exact longest run of free pages in section, caller holds its lock */
+static unsigned int hpa_section_max_run(struct hpa_section *section)
+{
+    unsigned long size = section->nr_pages, i = 0, end, max = 0;
+
+    while ((i = find_next_bit(section->free_map, size, i)) < size) {
+        end = find_next_zero_bit(section->free_map, size, i);
+        if (end - i > max)
+            max = end - i;
+        i = end;
+    }
+    return max;
+}
+
+/*
+ * Section selection policy for allocations. Round-robin spreads pages and
+ * lock traffic over every section; packed takes from the fullest section
+ * with free pages, so that others drain completely and can be offlined or
+ * used for contiguous allocations.
+ */
+enum {
+    HPA_ALLOC_ROUNDROBIN,
+    HPA_ALLOC_PACKED,
+};
+
+static int hpa_alloc_policy = HPA_ALLOC_ROUNDROBIN;
+module_param_named(alloc_policy, hpa_alloc_policy, int, 0644);
+
+static inline bool hpa_alloc_packed(void)
+{
+    return ACCESS_ONCE(hpa_alloc_policy) == HPA_ALLOC_PACKED;
+}
+
+/*
+ * Move section to the pack list of its current fill. Only a change of
+ * class takes pack_lock, once per power of two crossed. Kept up under
+ * either policy, so alloc_policy can be switched at runtime. Caller holds
+ * section->lock with irqs off.
+ */
+static void hpa_section_set_class(struct hpa_node *node, struct hpa_section *section)
+{
+    unsigned int class = fls_long(section->nr_free);
+
+    if (class == section->pack_class)
+        return;
+    spin_lock(&node->pack_lock);
+    if (section->pack_class) {
+        list_del_init(&section->pack_node);
+        if (list_empty(&node->pack_lists[section->pack_class]))
+            __clear_bit(section->pack_class, &node->pack_mask);
+    }
+    if (class) {
+        list_add_tail(&section->pack_node, &node->pack_lists[class]);
+        __set_bit(class, &node->pack_mask);
+    }
+    section->pack_class = class;
+    spin_unlock(&node->pack_lock);
+}
+
+/*
+ * The section with the fewest free pages, to within a factor of two.
+ * A hint like get_next_section's. NULL when the pack lists look empty or
+ * pack_lock is busy, the caller then falls back to round-robin so that
+ * refills never queue on the node-wide lock. irqs must be off.
+ */
+static struct hpa_section *hpa_fullest_section(struct hpa_node *node)
+{
+    struct hpa_section *section = NULL;
+    unsigned long class;
+
+    if (!ACCESS_ONCE(node->pack_mask))
+        return NULL;
+    if (!spin_trylock(&node->pack_lock))
+        return NULL;
+    class = find_first_bit(&node->pack_mask, HPA_PACK_CLASSES);
+    if (class < HPA_PACK_CLASSES)
+        section = list_first_entry(&node->pack_lists[class],
+                                   struct hpa_section, pack_node);
+    spin_unlock(&node->pack_lock);
+    return section;
+}
+
+/*
+ * Put page on its section free list and mark the section non-empty.
+ * Caller holds section->lock.
+ */
+static void __hpa_section_add_page(struct hugepage *page, struct hpa_section *section)
+{
+    int nid = hpa_page_to_nid(page);
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    unsigned long idx;
+
+    ClearHpaPageZeroed(page);
+    hpa_reset_page_idle(page);
+    if (list_empty(&section->free_list)) {
+        set_bit(hpa_section_nr(nid, section), node->section_map);
+        atomic_long_inc(&node->nr_free_sections);
+    }
+    list_add(&page->lru, &section->free_list);
+    idx = hpa_section_page_idx(section, page);
+    __set_bit(idx, section->free_map);
+    section->nr_free++;
+    hpa_section_note_free(section, idx);
+    hpa_section_set_class(node, section);
+}
+
+/*
+ * Round-robin over the sections that have free pages, starting after the
+ * last one used, or the fullest one under the packed policy. Returns NULL
+ * at once when the node is exhausted. The result is only a hint until the
+ * section lock is taken.
+ */
+static struct hpa_section *get_next_section(int nid)
+{
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    unsigned long max_nr_section = node->node_max_sections;
+    unsigned long nr_section;
+    struct hpa_section *section;
+
+    if (!atomic_long_read(&node->nr_free_sections))
+        return NULL;
+    /* pack_mask may lag nr_free_sections, the scan below covers that */
+    if (hpa_alloc_packed()) {
+        section = hpa_fullest_section(node);
+        if (section)
+            return section;
+    }
+
+    nr_section = find_next_bit(node->section_map, max_nr_section,
+                               ACCESS_ONCE(node->next_nr_section));
+    if (nr_section >= max_nr_section)
+        nr_section = find_first_bit(node->section_map, max_nr_section);
+    if (nr_section >= max_nr_section)
+        return NULL;
+
+    if ( nr_section + 2 >  max_nr_section )
+        node->next_nr_section = 0;
+    else
+        node->next_nr_section = nr_section + 1;
+
+    return &hpa_section_array[nid][nr_section];
+}
+
+/*
+ * Lock the next section with free pages. A contended section is skipped
+ * as long as there are other non-empty sections left to try. Every
+ * section looked at is added to *scanned.
+ */
+static struct hpa_section *hpa_lock_next_section(int nid, int *scanned)
+{
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    struct hpa_section *section;
+    long tries = 0;
+
+    for (;;) {
+        section = get_next_section(nid);
+        if (!section)
+            return NULL;
+        (*scanned)++;
+
+        if (!spin_trylock(&section->lock)) {
+            /* packed would pick the same section again, wait for it */
+            if (!hpa_alloc_packed() &&
+                ++tries < atomic_long_read(&node->nr_free_sections))
+                continue;
+            spin_lock(&section->lock);
+        }
+        /* raced with another cpu emptying it */
+        if (list_empty(&section->free_list)) {
+            spin_unlock(&section->lock);
+            continue;
+        }
+        return section;
+    }
+}
+
+/*
+ * Move up to count pages from the section lists to the tail of list,
+ * taking each section lock once for as many pages as it can give.
+ * irqs must be off.
+ */
+static int hpa_rmqueue_bulk(int nid, int count, struct list_head *list,
+                            int *scanned)
+{
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    struct hpa_section *section;
+    struct hugepage *page;
+    int i = 0;
+
+    while (i < count) {
+        section = hpa_lock_next_section(nid, scanned);
+        if (!section)
+            break;
+
+        while (i < count && !list_empty(&section->free_list)) {
+            page = list_first_entry(&section->free_list, struct hugepage, lru);
+            list_move_tail(&page->lru, list);
+            __clear_bit(hpa_section_page_idx(section, page), section->free_map);
+            section->nr_free--;
+            i++;
+        }
+        hpa_section_set_class(node, section);
+        if (list_empty(&section->free_list)) {
+            clear_bit(hpa_section_nr(nid, section), node->section_map);
+            atomic_long_dec(&node->nr_free_sections);
+        }
+        spin_unlock(&section->lock);
+    }
+    return i;
+}
+
+/* take one page off the section free lists, irqs must be off */
+static struct hugepage *__hpa_rmqueue(int nid, int *scanned)
+{
+    LIST_HEAD(list);
+
+    if (!hpa_rmqueue_bulk(nid, 1, &list, scanned))
+        return NULL;
+    return list_first_entry(&list, struct hugepage, lru);
+}
+
+/*
+ * Give back up to count pages taken from the tail of list, holding a
+ * section lock across runs of pages from the same section. Returns the
+ * number of pages moved. irqs must be off.
+ */
+static int hpa_free_list_to_sections(struct list_head *list, int count)
+{
+    struct hpa_section *section, *locked = NULL;
+    struct hugepage *page;
+    int i = 0;
+
+    while (i < count && !list_empty(list)) {
+        page = list_entry(list->prev, struct hugepage, lru);
+        section = hpa_page_section(page);
+        if (section != locked) {
+            if (locked)
+                spin_unlock(&locked->lock);
+            spin_lock(&section->lock);
+            locked = section;
+        }
+        list_del(&page->lru);
+        __hpa_section_add_page(page, section);
+        i++;
+    }
+    if (locked)
+        spin_unlock(&locked->lock);
+    return i;
+}
+
+/*
+ * Put the zeroed pages of section, or of every section when it is NULL,
+ * back on their free lists. Their clearing is lost.
+ */
+static void hpa_unzero_section(struct hpa_node *node, struct hpa_section *section)
+{
+    struct hugepage *page, *next;
+    unsigned long flags;
+    LIST_HEAD(list);
+    int nr = 0;
+
+    spin_lock_irq(&node->zero_lock);
+    list_for_each_entry_safe(page, next, &node->zeroed_list, lru) {
+        if (!section || hpa_page_section(page) == section) {
+            list_move(&page->lru, &list);
+            node->nr_zeroed--;
+            nr++;
+        }
+    }
+    spin_unlock_irq(&node->zero_lock);
+
+    local_irq_save(flags);
+    hpa_free_list_to_sections(&list, nr);
+    local_irq_restore(flags);
+}
+
+/* give back up to count of the coldest pages of pcp, irqs must be off */
+static void hpa_free_pcp_pages(struct hpa_pcp *pcp, int count)
+{
+    pcp->count -= hpa_free_list_to_sections(&pcp->list, count);
+}
+
 void __hpa_free_page(struct hugepage *page)
 {
 
@@ -50,34 +440,53 @@ void __hpa_free_page(struct hugepage *page)
 	struct hpa_section *section;
 	int nid;
 	struct hpa_node *node;
+	struct hpa_pcp *pcp;
+	u64 start = hpa_lat_start();
 	local_irq_save(flags);
 
 
 	/*from struct hugepage to nid and section*/
-	/*TODO for SMP add spin lock*/
 	section = hpa_page_section(page);
 
 	nid = hpa_page_to_nid(page);
 	node = HPA_NODE_DATA(nid);
 	if (!section) {
+		local_irq_restore(flags);
 		return;
 	}
 	if (PageLRU((struct page*)page)) {
+		spin_lock(&node->lru_lock);
 		__ClearPageLRU((struct page*)page);
 
-		list_move(&page->lru,&section->free_list);
+		list_del(&page->lru);
 		if (PageActive((struct page *)page)) {
 			node_page_state_add(-1, node, NR_ACTIVE_FILE);
 		} else {
 			node_page_state_add(-1, node, NR_INACTIVE_FILE);
 		}
+		spin_unlock(&node->lru_lock);
+	}
+	__ClearPageActive((struct page *)page);
+	if (unlikely(node->all_unreclaimable))
+		node->all_unreclaimable = 0;
+
+	if (node->pcp) {
+		ClearHpaPageZeroed(page);
+		hpa_reset_page_idle(page);
+		pcp = this_cpu_ptr(node->pcp);
+		list_add(&page->lru, &pcp->list);
+		if (++pcp->count > ACCESS_ONCE(hpa_pcp_high))
+			hpa_free_pcp_pages(pcp, hpa_pcp_get_batch());
 	} else {
-		list_add(&page->lru,&section->free_list);
+		spin_lock(&section->lock);
+		__hpa_section_add_page(page, section);
+		spin_unlock(&section->lock);
 	}
 	node_page_state_add(1, node, NR_FREE_PAGES);
+	count_hpa_event(node, HPA_FREE);
 
 	local_irq_restore(flags);
-	free_page++;
+	trace_hpa_free_page(page, hpa_lat_account(HPA_LAT_FREE, start));
 }
 EXPORT_SYMBOL(__hpa_free_page);
 
@@ -93,112 +502,782 @@ void hpa_free_page(struct hugepage *page)
 }
 EXPORT_SYMBOL(hpa_free_page);
 
-/*make sure page count is zero*/
-void hpa_free_page_list(struct list_head *list)
+/*
+ * make sure page count is zero
+ * Pages go straight back to their sections; the counters of each node are
+ * updated once per run of at most HPA_BULK_BATCH pages of that node.
+ * Boot time population passes count_free false to stay out of HPA_FREE.
+ */
+static void __hpa_free_page_list(struct list_head *list, bool count_free)
 {
     struct hugepage *page, *next;
+    struct hpa_node *node;
+    unsigned long flags;
+    int nid, nr, nr_active, nr_inactive;
+    LIST_HEAD(run);
 
-    list_for_each_entry_safe(page, next, list, lru) {
-        __hpa_free_page(page);
+    while (!list_empty(list)) {
+        nid = hpa_page_to_nid(list_first_entry(list, struct hugepage, lru));
+        node = HPA_NODE_DATA(nid);
+        nr = nr_active = nr_inactive = 0;
+
+        list_for_each_entry_safe(page, next, list, lru) {
+            if (hpa_page_to_nid(page) != nid || nr == HPA_BULK_BATCH)
+                break;
+            /* isolated from the lru by the caller but still accounted there */
+            if (PageLRU((struct page*)page)) {
+                __ClearPageLRU((struct page*)page);
+                if (PageActive((struct page *)page))
+                    nr_active++;
+                else
+                    nr_inactive++;
+            }
+            __ClearPageActive((struct page *)page);
+            list_move_tail(&page->lru, &run);
+            nr++;
+        }
+        if (unlikely(node->all_unreclaimable))
+            node->all_unreclaimable = 0;
+
+        local_irq_save(flags);
+        hpa_free_list_to_sections(&run, nr);
+        node_page_state_add(-nr_active, node, NR_ACTIVE_FILE);
+        node_page_state_add(-nr_inactive, node, NR_INACTIVE_FILE);
+        node_page_state_add(nr, node, NR_FREE_PAGES);
+        if (count_free)
+            count_hpa_events(node, HPA_FREE, nr);
+        local_irq_restore(flags);
     }
 }
+
+void hpa_free_page_list(struct list_head *list)
+{
+    __hpa_free_page_list(list, true);
+}
 EXPORT_SYMBOL(hpa_free_page_list);
 
+static int hpa_page_cmp(const void *a, const void *b)
+{
+    unsigned long pa = hpa_page_to_pfn(*(struct hugepage * const *)a);
+    unsigned long pb = hpa_page_to_pfn(*(struct hugepage * const *)b);
+
+    /* memmap chunks are per range and node, so pointer order is not pfn order */
+    return pa < pb ? -1 : pa > pb;
+}
 
-static struct list_head *get_next_section_list(int nid)
+/*
+ * Drop a reference on each of the nr pages and free those that reach zero.
+ * pages[] is sorted by pfn first so that lru_lock and every section lock
+ * are taken once per run of pages sharing them, at most HPA_BULK_BATCH
+ * pages per irq-off window.
+ */
+void hpa_free_pages_bulk(struct hugepage **pages, int nr)
 {
-    unsigned long nr_section = HPA_NODE_DATA(nid)->next_nr_section;
-    unsigned long max_nr_section = HPA_NODE_DATA(nid)->node_max_sections;
-    struct list_head *list = &hpa_section_array[nid][nr_section].free_list;
+    struct hugepage *page;
+    struct hpa_node *node;
+    unsigned long flags;
+    int i = 0, nid, batch, nr_freed, nr_active, nr_inactive;
+    LIST_HEAD(list);
 
-    if ( nr_section + 2 >  max_nr_section )
-        HPA_NODE_DATA(nid)->next_nr_section = 0;
-    else
-        HPA_NODE_DATA(nid)->next_nr_section++;
+    sort(pages, nr, sizeof(*pages), hpa_page_cmp, NULL);
 
-    return list;
+    while (i < nr) {
+        nid = hpa_page_to_nid(pages[i]);
+        node = HPA_NODE_DATA(nid);
+        batch = nr_freed = nr_active = nr_inactive = 0;
+
+        local_irq_save(flags);
+        spin_lock(&node->lru_lock);
+        for (; i < nr && batch < HPA_BULK_BATCH; i++, batch++) {
+            page = pages[i];
+            if (hpa_page_to_nid(page) != nid)
+                break;
+            if (!put_page_testzero((struct page*)page))
+                continue;
+            if (PageLRU((struct page*)page)) {
+                __ClearPageLRU((struct page*)page);
+                list_del(&page->lru);
+                if (PageActive((struct page *)page))
+                    nr_active++;
+                else
+                    nr_inactive++;
+            }
+            __ClearPageActive((struct page *)page);
+            /* sections take pages from the tail, keep pfn order */
+            list_add(&page->lru, &list);
+            nr_freed++;
+        }
+        spin_unlock(&node->lru_lock);
+
+        hpa_free_list_to_sections(&list, nr_freed);
+        node_page_state_add(-nr_active, node, NR_ACTIVE_FILE);
+        node_page_state_add(-nr_inactive, node, NR_INACTIVE_FILE);
+        node_page_state_add(nr_freed, node, NR_FREE_PAGES);
+        count_hpa_events(node, HPA_FREE, nr_freed);
+        local_irq_restore(flags);
+        if (nr_freed && unlikely(node->all_unreclaimable))
+            node->all_unreclaimable = 0;
+    }
 }
+EXPORT_SYMBOL(hpa_free_pages_bulk);
 
-struct hugepage *hpa_alloc_page_node(int nid)
+/* flush the pcp lists of cpu back to the sections, for every node */
+static void hpa_drain_pages(unsigned int cpu)
 {
     unsigned long flags;
+    struct hpa_pcp *pcp;
+    int nid;
+
+    for_each_huge_node(nid, HPNODE_MASK) {
+        if (!HPA_NODE_DATA(nid)->pcp)
+            continue;
+        local_irq_save(flags);
+        pcp = per_cpu_ptr(HPA_NODE_DATA(nid)->pcp, cpu);
+        hpa_free_pcp_pages(pcp, pcp->count);
+        local_irq_restore(flags);
+    }
+}
+
+void hpa_drain_local_pages(void *arg)
+{
+    hpa_drain_pages(smp_processor_id());
+}
+EXPORT_SYMBOL(hpa_drain_local_pages);
+
+/* must be called from a context that can sleep */
+void hpa_drain_all_pages(void)
+{
+    on_each_cpu(hpa_drain_local_pages, NULL, 1);
+}
+EXPORT_SYMBOL(hpa_drain_all_pages);
+
+/*
+ * Background zeroing: one low priority hp_zerod thread per node takes free
+ * pages off the sections, clears them and parks them on the node's zeroed
+ * list, marked with PG_hpa_zeroed so hpa_clear_huge_page can skip them.
+ * It keeps up to zerod_target pages there, clears at most one page every
+ * zerod_interval_ms and backs off while the node has fewer than
+ * zerod_target other free pages.
+ */
+static unsigned long hpa_zerod_target = 64;
+static unsigned int hpa_zerod_interval_ms = 10;
+module_param_named(zerod_target, hpa_zerod_target, ulong, 0644);
+module_param_named(zerod_interval_ms, hpa_zerod_interval_ms, uint, 0644);
+
+/* move up to count zeroed pages to the tail of list, irqs must be off */
+static int hpa_take_zeroed_pages(struct hpa_node *node, int count,
+        struct list_head *list)
+{
     struct hugepage *page;
-    struct list_head *list;
-    unsigned long max_num, pnum;
+    int i = 0;
 
-    local_irq_save(flags);
+    if (!ACCESS_ONCE(node->nr_zeroed))
+        return 0;
+
+    spin_lock(&node->zero_lock);
+    while (i < count && !list_empty(&node->zeroed_list)) {
+        page = list_first_entry(&node->zeroed_list, struct hugepage, lru);
+        list_move_tail(&page->lru, list);
+        node->nr_zeroed--;
+        i++;
+    }
+    spin_unlock(&node->zero_lock);
 
-    max_num = HPA_NODE_DATA(nid)->node_max_sections; 
+    if (i && node->hp_zerod && node->nr_zeroed < hpa_zerod_target / 2)
+        wake_up_process(node->hp_zerod);
+    return i;
+}
+
+static bool hpa_zerod_should_run(struct hpa_node *node)
+{
+    long nr_free = hpa_node_page_state(node, NR_FREE_PAGES);
+    unsigned long target = ACCESS_ONCE(hpa_zerod_target);
+
+    return node->nr_zeroed < target && nr_free - (long)node->nr_zeroed > (long)target;
+}
 
-    for (pnum = 0; pnum < max_num; pnum++) {
+static int hpa_zerod(void *data)
+{
+    struct hpa_node *node = data;
+    struct hugepage *page;
+    unsigned long flags;
+    int scanned = 0;
 
-        list = get_next_section_list(nid);
+    set_user_nice(current, 19);
 
-    
-        if (list_empty(list))
+    while (!kthread_should_stop()) {
+        page = NULL;
+        if (hpa_zerod_should_run(node)) {
+            local_irq_save(flags);
+            page = __hpa_rmqueue(node->nid, &scanned);
+            local_irq_restore(flags);
+        }
+        if (!page) {
+            set_current_state(TASK_INTERRUPTIBLE);
+            if (!kthread_should_stop())
+                schedule_timeout(HZ);
+            __set_current_state(TASK_RUNNING);
             continue;
-        else {
-            page = list_first_entry(list, struct hugepage, lru);
+        }
+
+        /* still accounted in NR_FREE_PAGES while it is being cleared */
+        hpa_zero_huge_page(page);
+        SetHpaPageZeroed(page);
+
+        spin_lock_irq(&node->zero_lock);
+        list_add_tail(&page->lru, &node->zeroed_list);
+        node->nr_zeroed++;
+        spin_unlock_irq(&node->zero_lock);
+
+        schedule_timeout_interruptible(msecs_to_jiffies(ACCESS_ONCE(hpa_zerod_interval_ms)));
+    }
+    return 0;
+}
+
+static int __init hpa_zerod_init(void)
+{
+    struct task_struct *tsk;
+    const struct cpumask *cpumask;
+    int nid;
+
+    for_each_huge_node(nid, HPNODE_MASK) {
+        tsk = kthread_create_on_node(hpa_zerod, HPA_NODE_DATA(nid), nid,
+                                     "hp_zerod/%d", nid);
+        if (IS_ERR(tsk)) {
+            pr_err("hpa: failed to start hp_zerod for node %d\n", nid);
+            continue;
+        }
+        cpumask = cpumask_of_node(nid);
+        if (!cpumask_empty(cpumask))
+            set_cpus_allowed_ptr(tsk, cpumask);
+        HPA_NODE_DATA(nid)->hp_zerod = tsk;
+        wake_up_process(tsk);
+    }
+    return 0;
+}
+late_initcall(hpa_zerod_init);
+
+/*
+ * alloc_flags of the internal allocation paths. HPA_AF_ZEROED is for
+ * callers that pass the page to hpa_clear_huge_page: only they may take
+ * pages off the zeroed list, which that call then skips clearing.
+ * HPA_AF_RECLAIM lets the allocation enter direct reclaim, so it may
+ * sleep.
+ */
+#define HPA_AF_ZEROED       0x1
+#define HPA_AF_RECLAIM      0x2
+
+static struct hugepage *__hpa_alloc_page_node(int nid, int alloc_flags)
+{
+    unsigned long flags;
+    struct hugepage *page = NULL;
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    struct hpa_pcp *pcp;
+    u64 start = hpa_lat_start();
+    int scanned = 0;
+    LIST_HEAD(list);
+
+    local_irq_save(flags);
+
+    if ((alloc_flags & HPA_AF_ZEROED) &&
+        hpa_take_zeroed_pages(node, 1, &list)) {
+        page = list_first_entry(&list, struct hugepage, lru);
+        list_del(&page->lru);
+    } else if (node->pcp) {
+        pcp = this_cpu_ptr(node->pcp);
+        if (list_empty(&pcp->list))
+            pcp->count += hpa_rmqueue_bulk(nid, hpa_pcp_get_batch(),
+                                           &pcp->list, &scanned);
+        if (!list_empty(&pcp->list)) {
+            page = list_first_entry(&pcp->list, struct hugepage, lru);
             list_del(&page->lru);
+            pcp->count--;
+        }
+    } else
+        page = __hpa_rmqueue(nid, &scanned);
+
+    if (!page) {
+        /*failed*/
+        count_hpa_event(node, HPA_ALLOC_EMPTY);
+        local_irq_restore(flags);
+        trace_hpa_alloc_page_node(nid, NULL, scanned,
+                                  hpa_lat_account(HPA_LAT_ALLOC, start));
+        hpa_wakeup_kswapd(node);
+        return NULL;
+    }
+
+    count_hpa_event(node, HPA_ALLOC);
+    if (!(alloc_flags & HPA_AF_ZEROED))
+        ClearHpaPageZeroed(page);
+    set_page_refcounted((struct page*)page);
+    //add to lru[LRU_INACTIVE_FILE] list
+    add_hpage_to_lruvec(page, LRU_INACTIVE_FILE);
+    local_irq_restore(flags);
+    trace_hpa_alloc_page_node(nid, page, scanned,
+                              hpa_lat_account(HPA_LAT_ALLOC, start));
+    hpa_wakeup_kswapd(node);
+    return page;
+}
+
+/* never takes zeroed pages, the caller need not clear the page */
+struct hugepage *hpa_alloc_page_node(int nid)
+{
+    return __hpa_alloc_page_node(nid, 0);
+}
+EXPORT_SYMBOL(hpa_alloc_page_node);
 
+/*
+ * Allocate up to nr pages from node nid into pages[], returning how many
+ * were allocated. Section locks, lru_lock and the node counters are taken
+ * once per batch of HPA_BULK_BATCH pages rather than once per page. The
+ * local pcp list is only used when the sections run short. Zeroed pages
+ * are not handed out, they go back to the sections before giving up.
+ */
+int hpa_alloc_pages_bulk(int nid, int nr, struct hugepage **pages)
+{
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    struct hugepage *page;
+    struct hpa_pcp *pcp;
+    unsigned long flags;
+    int got = 0, batch, n, scanned = 0;
+    bool unzeroed = false;
+    LIST_HEAD(list);
+
+    while (got < nr) {
+        batch = min(nr - got, HPA_BULK_BATCH);
+
+        local_irq_save(flags);
+        n = hpa_rmqueue_bulk(nid, batch, &list, &scanned);
+        if (n < batch && node->pcp) {
+            pcp = this_cpu_ptr(node->pcp);
+            while (n < batch && !list_empty(&pcp->list)) {
+                list_move_tail(pcp->list.next, &list);
+                pcp->count--;
+                n++;
+            }
+        }
+        local_irq_restore(flags);
+        if (n < batch && !unzeroed && ACCESS_ONCE(node->nr_zeroed)) {
+            unzeroed = true;
+            hpa_unzero_section(node, NULL);
+            local_irq_save(flags);
+            n += hpa_rmqueue_bulk(nid, batch - n, &list, &scanned);
+            local_irq_restore(flags);
+        }
+        count_hpa_events(node, HPA_ALLOC, n);
+
+        if (!n)
+            break;
+
+        list_for_each_entry(page, &list, lru) {
+            ClearHpaPageZeroed(page);
             set_page_refcounted((struct page*)page);
-			//add to lru[LRU_INACTIVE_FILE] list
-			add_hpage_to_lruvec(page, LRU_INACTIVE_FILE);
+            pages[got++] = page;
+        }
+        add_hpage_list_to_lruvec(&list, nid, n, LRU_INACTIVE_FILE);
+
+        if (n < batch)
+            break;
+    }
+    hpa_wakeup_kswapd(node);
+    return got;
+}
+EXPORT_SYMBOL(hpa_alloc_pages_bulk);
+
+/*
+ * First index of a run of nr free pages in section whose pfn is a multiple
+ * of align hugepages, or -1. Each hole found moves the search past it to
+ * the next aligned index, so this costs a bitmap scan of the section.
+ */
+static long hpa_section_find_run(struct hpa_section *section,
+        unsigned long size, int nr, unsigned long align)
+{
+    unsigned long base = section->start_pfn >> 9;
+    unsigned long i, hole;
+
+    i = ALIGN(base, align) - base;
+    while (i + nr <= size) {
+        hole = find_next_zero_bit(section->free_map, i + nr, i);
+        if (hole >= i + nr)
+            return i;
+        i = ALIGN(base + hole + 1, align) - base;
+    }
+    return -1;
+}
+
+/*
+ * Allocate nr physically contiguous pages from node nid, the first one at
+ * a pfn aligned to align hugepages, a power of two. A run never spans
+ * sections, so nr is at most SECTION_SIZE, never below the 512 of a 1GB
+ * page. The pages come back referenced, off the LRU and not cleared.
+ * Returns the first page or NULL. May sleep, to drain the pcp lists
+ * before giving up. Sections whose max_run is below nr are skipped
+ * without taking their lock.
+ */
+struct hugepage *hpa_alloc_contig_pages(int nid, int nr, int align)
+{
+    struct hpa_node *node;
+    struct hpa_section *section;
+    struct hugepage *page = NULL;
+    unsigned long pnum, size, flags, i;
+    bool drained = false;
+    long idx;
+
+    if (!is_hpa_node(nid) || nr <= 0 || (unsigned long)nr > SECTION_SIZE)
+        return NULL;
+    if (align <= 0)
+        align = 1;
+    if (!is_power_of_2(align))
+        return NULL;
+    node = HPA_NODE_DATA(nid);
+
+retry:
+    for (pnum = 0; pnum < node->node_max_sections; pnum++) {
+        section = &hpa_section_array[nid][pnum];
+        if (ACCESS_ONCE(section->max_run) < nr)
+            continue;
+        size = section->nr_pages;
+
+        local_irq_save(flags);
+        spin_lock(&section->lock);
+        idx = hpa_section_find_run(section, size, nr, align);
+        if (idx >= 0) {
+            page = hpa_pfn_to_page(section->start_pfn + (idx << 9));
+            for (i = 0; i < nr; i++) {
+                list_del(&page[i].lru);
+                INIT_LIST_HEAD(&page[i].lru);
+            }
+            bitmap_clear(section->free_map, idx, nr);
+            section->nr_free -= nr;
+            hpa_section_set_class(node, section);
+            if (list_empty(&section->free_list)) {
+                clear_bit(pnum, node->section_map);
+                atomic_long_dec(&node->nr_free_sections);
+            }
+        } else
+            section->max_run = hpa_section_max_run(section);
+        spin_unlock(&section->lock);
+
+        if (page) {
+            node_page_state_add(-nr, node, NR_FREE_PAGES);
+            count_hpa_events(node, HPA_ALLOC, nr);
             local_irq_restore(flags);
-            free_page--;
-		return page;
+            for (i = 0; i < nr; i++)
+                set_page_refcounted((struct page*)&page[i]);
+            hpa_wakeup_kswapd(node);
+            return page;
         }
+        local_irq_restore(flags);
     }
 
-    /*failed*/
-    local_irq_restore(flags);
+    /* pages parked in pcp or zeroed lists may be the holes */
+    if (!drained) {
+        drained = true;
+        hpa_drain_all_pages();
+        hpa_unzero_section(node, NULL);
+        goto retry;
+    }
+    count_hpa_event(node, HPA_ALLOC_FAIL);
     return NULL;
 }
-EXPORT_SYMBOL(hpa_alloc_page_node);
+EXPORT_SYMBOL(hpa_alloc_contig_pages);
 
-struct hugepage *hpa_alloc_page(void)
+/* drop the references hpa_alloc_contig_pages gave to a run of nr pages */
+void hpa_free_contig_pages(struct hugepage *page, int nr)
 {
-	struct hugepage *page;
-	int nid;
-	for_each_node_mask(nid, node_possible_map) { 
-		if((1UL<<nid)&hpnode_mask) {		
-			page=hpa_alloc_page_node(nid);
-			if(page!=NULL) return page;		
+    LIST_HEAD(list);
+    int i;
+
+    for (i = 0; i < nr; i++)
+        if (put_page_testzero((struct page*)&page[i]))
+            list_add_tail(&page[i].lru, &list);
+    hpa_free_page_list(&list);
+}
+EXPORT_SYMBOL(hpa_free_contig_pages);
+
+/*
+ * Nearest HPA node to nid that is allowed by nodemask and not yet set in
+ * *tried, which is updated. Ties go to the lower node id.
+ */
+int hpa_next_best_node(int nid, nodemask_t *nodemask, unsigned long *tried)
+{
+	int n, dist, best = NUMA_NO_NODE, min_dist = INT_MAX;
+
+	for_each_huge_node(n, HPNODE_MASK) {
+		if (*tried & (1UL << n))
+			continue;
+		if (nodemask && !node_isset(n, *nodemask))
+			continue;
+		dist = node_distance(nid, n);
+		if (dist < min_dist) {
+			min_dist = dist;
+			best = n;
 		}
 	}
+	if (best != NUMA_NO_NODE)
+		*tried |= 1UL << best;
+	return best;
+}
+
+static struct hugepage *__hpa_alloc_page_nodemask(int preferred_nid,
+		nodemask_t *nodemask, int alloc_flags)
+{
+	struct hugepage *page;
+	unsigned long tried = 0;
+	int nid = preferred_nid;
+
+	if (is_hpa_node(nid) && (!nodemask || node_isset(nid, *nodemask)))
+		tried |= 1UL << nid;
+	else
+		nid = hpa_next_best_node(preferred_nid, nodemask, &tried);
+
+	while (nid != NUMA_NO_NODE) {
+		page = __hpa_alloc_page_node(nid, alloc_flags);
+		if (page)
+			return page;
+		nid = hpa_next_best_node(preferred_nid, nodemask, &tried);
+	}
 	return NULL;
 }
+
+/*
+ * Direct reclaim statistics, readable as hpa.direct_reclaim_<name>: calls,
+ * calls that ended with a page, pages reclaimed, and the total and worst
+ * time spent in a call.
+ */
+atomic_long_t hpa_dr_stat[NR_HPA_DR_STAT];
+
+static int hpa_param_get_atomic_long(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%ld", atomic_long_read((atomic_long_t *)kp->arg));
+}
+
+static const struct kernel_param_ops hpa_param_ops_atomic_long = {
+	.get = hpa_param_get_atomic_long,
+};
+module_param_cb(direct_reclaim_calls, &hpa_param_ops_atomic_long,
+		&hpa_dr_stat[HPA_DR_CALLS], 0444);
+module_param_cb(direct_reclaim_success, &hpa_param_ops_atomic_long,
+		&hpa_dr_stat[HPA_DR_SUCCESS], 0444);
+module_param_cb(direct_reclaim_pages, &hpa_param_ops_atomic_long,
+		&hpa_dr_stat[HPA_DR_RECLAIMED], 0444);
+module_param_cb(direct_reclaim_total_us, &hpa_param_ops_atomic_long,
+		&hpa_dr_stat[HPA_DR_TOTAL_US], 0444);
+module_param_cb(direct_reclaim_max_us, &hpa_param_ops_atomic_long,
+		&hpa_dr_stat[HPA_DR_MAX_US], 0444);
+
+/* reclaim a small batch within a bounded budget, then retry once */
+static struct hugepage *hpa_alloc_page_slowpath(int preferred_nid,
+		nodemask_t *nodemask, int alloc_flags)
+{
+	struct hugepage *page = NULL;
+	unsigned long nr_reclaimed;
+	long us, max;
+	u64 start;
+
+	if (current->flags & PF_MEMALLOC)
+		return NULL;
+
+	start = local_clock();
+	nr_reclaimed = hpa_direct_reclaim(preferred_nid, nodemask);
+	if (nr_reclaimed)
+		page = __hpa_alloc_page_nodemask(preferred_nid, nodemask,
+						 alloc_flags);
+	us = div_u64(local_clock() - start, NSEC_PER_USEC);
+
+	atomic_long_inc(&hpa_dr_stat[HPA_DR_CALLS]);
+	if (page)
+		atomic_long_inc(&hpa_dr_stat[HPA_DR_SUCCESS]);
+	atomic_long_add(nr_reclaimed, &hpa_dr_stat[HPA_DR_RECLAIMED]);
+	atomic_long_add(us, &hpa_dr_stat[HPA_DR_TOTAL_US]);
+	max = atomic_long_read(&hpa_dr_stat[HPA_DR_MAX_US]);
+	while (us > max) {
+		long old = atomic_long_cmpxchg(&hpa_dr_stat[HPA_DR_MAX_US], max, us);
+		if (old == max)
+			break;
+		max = old;
+	}
+	return page;
+}
+
+/*
+ * Allocate from preferred_nid, falling back to the other HPA nodes in
+ * nodemask (all of them if NULL) in node_distance() order. Without
+ * HPA_AF_RECLAIM this never sleeps, but it may send IPIs to drain the pcp
+ * lists, so irqs must be on.
+ */
+static struct hugepage *hpa_alloc_page_flags(int preferred_nid,
+		nodemask_t *nodemask, int alloc_flags)
+{
+	struct hugepage *page;
+	int nid;
+
+	page = __hpa_alloc_page_nodemask(preferred_nid, nodemask, alloc_flags);
+	/*
+	 * the last free pages may sit in other cpus' pcp lists, or on zeroed
+	 * lists this caller may not take from
+	 */
+	if (!page && hpa_nr_free_pages()) {
+		hpa_drain_all_pages();
+		if (!(alloc_flags & HPA_AF_ZEROED))
+			for_each_huge_node(nid, HPNODE_MASK)
+				if (ACCESS_ONCE(HPA_NODE_DATA(nid)->nr_zeroed))
+					hpa_unzero_section(HPA_NODE_DATA(nid), NULL);
+		page = __hpa_alloc_page_nodemask(preferred_nid, nodemask,
+						 alloc_flags);
+	}
+	if (!page && (alloc_flags & HPA_AF_RECLAIM))
+		page = hpa_alloc_page_slowpath(preferred_nid, nodemask, alloc_flags);
+	if (!page && is_hpa_node(preferred_nid))
+		count_hpa_event(HPA_NODE_DATA(preferred_nid), HPA_ALLOC_FAIL);
+	return page;
+}
+
+struct hugepage *hpa_alloc_page_nodemask(int preferred_nid, nodemask_t *nodemask)
+{
+	return hpa_alloc_page_flags(preferred_nid, nodemask, 0);
+}
+EXPORT_SYMBOL(hpa_alloc_page_nodemask);
+
+/*
+ * Like hpa_alloc_page_nodemask, but when every allowed node is empty it
+ * reclaims a bounded batch from the node LRUs and retries once. Sleeps:
+ * call it only from process context without spinlocks held.
+ */
+struct hugepage *hpa_alloc_page_reclaim(int preferred_nid, nodemask_t *nodemask)
+{
+	might_sleep();
+	return hpa_alloc_page_flags(preferred_nid, nodemask, HPA_AF_RECLAIM);
+}
+EXPORT_SYMBOL(hpa_alloc_page_reclaim);
+
+struct hugepage *hpa_alloc_page(void)
+{
+	return hpa_alloc_page_nodemask(numa_node_id(), NULL);
+}
 EXPORT_SYMBOL(hpa_alloc_page);
 
+/*
+ * Allocate for a fault at address in vma, honouring the vma/task mempolicy
+ * the same way hugetlb does: interleave picks the node from the offset,
+ * bind restricts the fallback to its nodemask, preferred and local start
+ * from their node. The page may come off a zeroed list, so the caller must
+ * pass it to hpa_clear_huge_page before mapping it. May sleep in direct
+ * reclaim like hpa_alloc_page_reclaim.
+ */
+struct hugepage *hpa_alloc_page_vma(struct vm_area_struct *vma, unsigned long address)
+{
+	struct hugepage *page;
+	struct mempolicy *mpol;
+	nodemask_t *nodemask;
+	struct zonelist *zonelist;
+	struct zone *zone;
+	int nid = numa_node_id();
+
+	zonelist = huge_zonelist(vma, address, GFP_HIGHUSER, &mpol, &nodemask);
+	first_zones_zonelist(zonelist, gfp_zone(GFP_HIGHUSER), nodemask, &zone);
+	if (zone)
+		nid = zone_to_nid(zone);
+
+	might_sleep();
+	page = hpa_alloc_page_flags(nid, nodemask,
+				    HPA_AF_ZEROED | HPA_AF_RECLAIM);
+	mpol_cond_put(mpol);
+	return page;
+}
+EXPORT_SYMBOL(hpa_alloc_page_vma);
+
 
 /* get_XXX function currently is fix-returned
  * we will calculate accordingly in the future
  * */
 static unsigned long get_section_num(unsigned long nr_pages)
 {
-    unsigned long ret = (nr_pages + ((1 << 11) -1) )>> 11;
+    unsigned long ret = (nr_pages + (SECTION_SIZE - 1)) >> SECTION_SHIFT;
     //BUG_ON (ret != 1);
     return ret; 
 }
 
+/*
+ * Boot memory on node nid, so the metadata of a node's hugepages sits
+ * next to the CPUs that fault them. Falls back to any node.
+ */
+static void * __init hpa_alloc_bootmem_node(int nid, unsigned long size)
+{
+    void *ptr = NULL;
+
+    if (node_online(nid))
+        ptr = alloc_bootmem_node_nopanic(NODE_DATA(nid), size);
+    if (!ptr)
+        ptr = alloc_bootmem(size);
+    return ptr;
+}
+
+/* the part of range r inside the span of node nid, false if none */
+static bool hpa_node_range_span(int nid, struct hpa_range *r,
+        unsigned long *start_pfn, unsigned long *end_pfn)
+{
+    *start_pfn = max(r->start_pfn, hpa_node_start[nid]);
+    *end_pfn = min(r->end_pfn, hpa_node_end[nid]);
+    return *start_pfn < *end_pfn;
+}
+
+/* sections are cut per range, so none straddles a hole */
+static unsigned long hpa_node_section_num(int nid, unsigned long *present)
+{
+    unsigned long start_pfn, end_pfn, num_section = 0;
+    int i;
+
+    *present = 0;
+    for (i = 0; i < hpa_nr_ranges; i++) {
+        if (!hpa_node_range_span(nid, &hpa_ranges[i], &start_pfn, &end_pfn))
+            continue;
+        *present += (end_pfn - start_pfn) >> 9;
+        num_section += get_section_num((end_pfn - start_pfn) >> 9);
+    }
+    return num_section;
+}
+
 static void __init hpa_alloc_section_node(int nid)
 {
 
     unsigned long num_section;
-    unsigned long pnum;
+    unsigned long pnum, pfn, start_pfn, end_pfn;
+    int i;
     struct hpa_section *section;
+    unsigned long *map, *free_map;
+    size_t size;
     /*allocation of section*/
     num_section = HPA_NODE_DATA(nid)->node_max_sections;
     if (num_section != 0) {
-        section = alloc_bootmem(PAGE_SIZE);
+        /* sections are cache line padded, so size the array from the count */
+        size = PAGE_ALIGN(num_section * sizeof(struct hpa_section));
+        section = hpa_alloc_bootmem_node(nid, size);
         if (!section) {
             pr_err("Cannot find %zu bytes in node %d\n",
-                    PAGE_SIZE, nid);
+                    size, nid);
             return;
         }
+        map = hpa_alloc_bootmem_node(nid, BITS_TO_LONGS(num_section) * sizeof(long));
+        bitmap_zero(map, num_section);
+        /* SECTION_SIZE is a multiple of BITS_PER_LONG, one slice each */
+        free_map = hpa_alloc_bootmem_node(nid, num_section * SECTION_SIZE / BITS_PER_BYTE);
+        HPA_NODE_DATA(nid)->section_map = map;
         hpa_section_array[nid] = section;
-        for (pnum=0; pnum < num_section; pnum++) {
-            INIT_LIST_HEAD(&section[pnum].free_list);
+        pnum = 0;
+        for (i = 0; i < hpa_nr_ranges; i++) {
+            if (!hpa_node_range_span(nid, &hpa_ranges[i], &start_pfn, &end_pfn))
+                continue;
+            /* only the last section of each range may be short */
+            for (pfn = start_pfn; pfn < end_pfn; pfn += SECTION_SIZE << 9, pnum++) {
+                spin_lock_init(&section[pnum].lock);
+                INIT_LIST_HEAD(&section[pnum].free_list);
+                INIT_LIST_HEAD(&section[pnum].pack_node);
+                section[pnum].free_map = free_map + pnum * BITS_TO_LONGS(SECTION_SIZE);
+                section[pnum].start_pfn = pfn;
+                section[pnum].nr_pages = min_t(unsigned long, SECTION_SIZE,
+                                               (end_pfn - pfn) >> 9);
+            }
         }
     }
     else
@@ -208,12 +1287,14 @@ static void __init hpa_alloc_section_node(int nid)
 static void hpa_init_mem_mapping(void)
 {
     unsigned long start,end;
+    int i;
 
-    start = hpa_start_pfn << 12;
-    end = (hpa_start_pfn << 12)+ (hpa_nr_pages << 21);
-
-    init_memory_mapping(start,end);
-
+    /* the holes between ranges are not ours to map */
+    for (i = 0; i < hpa_nr_ranges; i++) {
+        start = hpa_ranges[i].start_pfn << 12;
+        end = hpa_ranges[i].end_pfn << 12;
+        init_memory_mapping(start,end);
+    }
 }
 
 static void hpa_memmap_init(unsigned long size, int nid,
@@ -233,6 +1314,26 @@ static void hpa_memmap_init(unsigned long size, int nid,
 
 }
 
+/* one waitqueue per hugepage, between 4 and 4096 per node */
+static void __init hpa_alloc_wait_table(struct hpa_node *node)
+{
+	unsigned long entries, i;
+
+	entries = roundup_pow_of_two(clamp(node->node_present_pages, 4UL, 4096UL));
+	node->wait_table_bits = ilog2(entries);
+	node->wait_table = hpa_alloc_bootmem_node(node->node_id,
+						  entries * sizeof(wait_queue_head_t));
+	for (i = 0; i < entries; i++)
+		init_waitqueue_head(&node->wait_table[i]);
+}
+
+/* capped for small nodes, the high mark is half as much again */
+static void hpa_node_set_watermarks(struct hpa_node *node)
+{
+	node->watermark = min(500UL, node->node_present_pages / 16);
+	node->watermark_high = node->watermark + node->watermark / 2;
+}
+
 /* according to function setup_node_data from arch/x86/mm/numa.c */
 static void __init hpa_alloc_node_data(int nid)
 {
@@ -240,14 +1341,15 @@ static void __init hpa_alloc_node_data(int nid)
 	const size_t nd_size = roundup(sizeof(struct hpa_node), PAGE_SIZE);
 	//u64 nd_pa;
 	void * nd;
-	unsigned long size, start_pfn;
+	unsigned long size, start_pfn, present;
 	unsigned long num_section;
 	struct hpa_node *node = NULL;
 	struct lruvec *lruvec;
 
 	struct list_head *lru_active,*lru_inactive;
+	int i;
 
-	nd = alloc_bootmem(nd_size);
+	nd = hpa_alloc_bootmem_node(nid, nd_size);
 	//if (!nd_pa) {
 	//    pr_err("Cannot find %zu bytes in node %d\n",
 	//            nd_size, nid);
@@ -262,18 +1364,24 @@ static void __init hpa_alloc_node_data(int nid)
 	lruvec = &node->lruvec;
 	start_pfn = hpa_node_start[nid];
 	size = (hpa_node_end[nid]-hpa_node_start[nid]) >> 9;
-	/*one section is 4G, num is got by being divided by nr_pages * 2M*/
-	num_section = get_section_num(size);
+	/*one section is SECTION_SIZE at most, and does not cross a range*/
+	num_section = hpa_node_section_num(nid, &present);
 
 	/*We need a macro HPA_NODE_DATA*/
 	memset(node,0,sizeof(struct hpa_node));
 	node->node_id = nid;
 	node->node_start_pfn = start_pfn;
 	node->node_spanned_pages = size;
-	node->node_present_pages = size;
+	node->node_present_pages = present;
 	node->node_max_sections = num_section;
 	node->next_nr_section = 0;
 	node->nid = nid;
+	spin_lock_init(&node->lru_lock);
+	spin_lock_init(&node->zero_lock);
+	INIT_LIST_HEAD(&node->zeroed_list);
+	spin_lock_init(&node->pack_lock);
+	for (i = 0; i < HPA_PACK_CLASSES; i++)
+		INIT_LIST_HEAD(&node->pack_lists[i]);
 
 	lruvec->lists[LRU_INACTIVE_FILE].prev = &lruvec->lists[LRU_INACTIVE_FILE];
 	lruvec->lists[LRU_INACTIVE_FILE].next = &lruvec->lists[LRU_INACTIVE_FILE];
@@ -287,7 +1395,9 @@ static void __init hpa_alloc_node_data(int nid)
             lru_inactive=&lruvec->lists[LRU_INACTIVE_FILE];
 
 	node->pages_scanned = 0;
-	node->watermark = 500;
+	hpa_node_set_watermarks(node);
+	init_waitqueue_head(&node->kswapd_wait);
+	hpa_alloc_wait_table(node);
 	atomic_long_set(&node->vm_stat[NR_FREE_PAGES], 0);
 	/*
 	   INIT_LIST_HEAD(&node->section_list); 
@@ -298,80 +1408,629 @@ static void __init hpa_alloc_node_data(int nid)
 	return;
 }
 
+/*
+ * Sections of every node populated synchronously by hpa_init. The rest
+ * are populated by one kthread per node, in parallel and in the
+ * background unless hpa_defer_init=0 asks boot to wait for them.
+ */
+static unsigned long hpa_boot_sections = 1;
+static bool hpa_defer_init = true;
+
+static int __init hpa_boot_sections_setup(char *p)
+{
+    return kstrtoul(p, 0, &hpa_boot_sections);
+}
+early_param("hpa_boot_sections", hpa_boot_sections_setup);
+
+static int __init hpa_defer_init_setup(char *p)
+{
+    return strtobool(p, &hpa_defer_init);
+}
+early_param("hpa_defer_init", hpa_defer_init_setup);
+
+/*
+ * hpa_section_size=<size>, a power of two between 1G and 128G. Smaller
+ * sections spread lock contention, larger ones keep the arrays small.
+ */
+static int __init hpa_section_size_setup(char *p)
+{
+    unsigned long long size = memparse(p, &p);
+    unsigned int shift;
+
+    if (!size || !is_power_of_2(size) || size < HUGEPAGE_SIZE)
+        return -EINVAL;
+    shift = ilog2(size) - ilog2(HUGEPAGE_SIZE);
+    if (shift < HPA_SECTION_SHIFT_MIN || shift > HPA_SECTION_SHIFT_MAX) {
+        pr_warn("hpa: hpa_section_size=%llu out of range, keeping %lu\n",
+                size, SECTION_SIZE * HUGEPAGE_SIZE);
+        return -EINVAL;
+    }
+    hpa_section_shift = shift;
+    return 0;
+}
+early_param("hpa_section_size", hpa_section_size_setup);
+
+/*
+ * Set up the memmap of sections [from, to) of node nid and hand their
+ * pages to the section free lists. Returns the number of pages.
+ */
+static unsigned long hpa_init_node_sections(int nid, unsigned long from,
+        unsigned long to)
+{
+    unsigned long pnum, pfn, start_pfn, end_pfn, nr_pages = 0;
+    struct hugepage *page;
+    LIST_HEAD(list);
+    int nr = 0;
+
+    for (pnum = from; pnum < to; pnum++) {
+        start_pfn = hpa_section_array[nid][pnum].start_pfn;
+        end_pfn = start_pfn + (hpa_section_array[nid][pnum].nr_pages << 9);
+        hpa_memmap_init((end_pfn - start_pfn) >> 9, nid, start_pfn, pnum);
+
+        for (pfn = start_pfn; pfn < end_pfn; pfn += 512) {
+            page = hpa_pfn_to_page(pfn);
+            atomic_set(&page->_mapcount, -1);
+            list_add_tail(&page->lru, &list);
+            if (++nr == HPA_BULK_BATCH) {
+                __hpa_free_page_list(&list, false);
+                nr_pages += nr;
+                nr = 0;
+            }
+        }
+        __hpa_free_page_list(&list, false);
+        nr_pages += nr;
+        nr = 0;
+        cond_resched();
+    }
+    return nr_pages;
+}
+
 static void __init hpa_nodes_init(void)
 {
+    unsigned long nr_pages = 0;
+    u64 start = local_clock();
     int nid;
     /*TODO instead of possible map we should setup our own map*/
     for_each_node_mask(nid, node_possible_map) {
         if((1UL<<nid)&hpnode_mask) {
-	unsigned long pnum, num_section;
-        /*default section is 4G which is 1^11 hugepages*/
-        unsigned long start_pfn = hpa_node_start[nid], size = 1 << 20;
-        hpa_alloc_node_data(nid);
-        num_section = HPA_NODE_DATA(nid)->node_max_sections;
-	for( pnum = 0; pnum < num_section; pnum++, start_pfn+=size) {
-            if ( pnum == num_section - 1 ) 
-                size = (hpa_node_end[nid]-start_pfn) >> 9;
-            hpa_memmap_init(size,nid,start_pfn,pnum);
+            hpa_alloc_node_data(nid);
         }
-        init_waitqueue_head(&HPA_NODE_DATA(nid)->waitq);
-	}
     }
     hpa_init_mem_mapping();
+
+    for_each_huge_node(nid, HPNODE_MASK)
+        nr_pages += hpa_init_node_sections(nid, 0,
+                min(hpa_boot_sections, HPA_NODE_DATA(nid)->node_max_sections));
+
+    pr_info("hpa: %lu of %lu hugepages initialised at boot in %llu us\n",
+            nr_pages, hpa_nr_pages, div_u64(local_clock() - start, NSEC_PER_USEC));
     return;
 }
 
-static unsigned long hpa_free_all_boot_hugepages(void)
+static atomic_t hpa_init_pending = ATOMIC_INIT(1);
+static DECLARE_COMPLETION(hpa_init_done);
+static u64 hpa_init_start;
+
+static void hpa_init_thread_done(void)
 {
-    unsigned long start_pfn = hpa_start_pfn;
-    unsigned long end_pfn = start_pfn + (hpa_nr_pages << 9);
-    unsigned long pfn;
-    struct hugepage * page;
-    for (pfn = start_pfn; pfn < end_pfn; pfn+=512) {
-        page = hpa_pfn_to_page(pfn);
-        atomic_set(&page->_mapcount, -1);
-        set_page_refcounted((struct page*)page);
-        hpa_free_page(page);
+    if (!atomic_dec_and_test(&hpa_init_pending))
+        return;
+    pr_info("hpa: deferred init finished in %llu ms wall time\n",
+            div_u64(local_clock() - hpa_init_start, NSEC_PER_MSEC));
+    complete_all(&hpa_init_done);
+}
+
+/* populates the sections hpa_init left to this node */
+static int hpa_init_node_thread(void *data)
+{
+    int nid = (long)data;
+    unsigned long from = min(hpa_boot_sections, HPA_NODE_DATA(nid)->node_max_sections);
+    unsigned long nr_pages;
+    u64 start = local_clock();
+
+    nr_pages = hpa_init_node_sections(nid, from, HPA_NODE_DATA(nid)->node_max_sections);
+    pr_info("hpa: node %d: %lu hugepages initialised in %llu ms\n",
+            nid, nr_pages, div_u64(local_clock() - start, NSEC_PER_MSEC));
+    hpa_init_thread_done();
+    return 0;
+}
+
+static int __init hpa_deferred_init(void)
+{
+    const struct cpumask *cpumask;
+    struct task_struct *tsk;
+    int nid;
+
+    hpa_init_start = local_clock();
+    for_each_huge_node(nid, HPNODE_MASK) {
+        if (hpa_boot_sections >= HPA_NODE_DATA(nid)->node_max_sections)
+            continue;
+        atomic_inc(&hpa_init_pending);
+        tsk = kthread_create_on_node(hpa_init_node_thread, (void *)(long)nid,
+                                     nid, "hpa_init/%d", nid);
+        if (IS_ERR(tsk)) {
+            hpa_init_node_thread((void *)(long)nid);
+            continue;
+        }
+        cpumask = cpumask_of_node(nid);
+        if (!cpumask_empty(cpumask))
+            set_cpus_allowed_ptr(tsk, cpumask);
+        wake_up_process(tsk);
+    }
+    hpa_init_thread_done();
+
+    if (!hpa_defer_init)
+        wait_for_completion(&hpa_init_done);
+    return 0;
+}
+core_initcall(hpa_deferred_init);
+
+/*
+ * Runtime resizing of the pool, a whole section at a time. A section can
+ * only go offline while every one of its pages is on its free list; it is
+ * then emptied under its lock, which allocators see as just another empty
+ * section, and its memory is handed to the buddy allocator. Onlining takes
+ * the memory back with alloc_contig_range, so that needs CONFIG_CMA. The
+ * memmap of an offline section stays, pfns never move.
+ *
+ * The hand-off needs the buddy allocator's struct pages and zone for the
+ * pfns, so sections of memory that was kept out of the core memory model
+ * cannot go offline. Onlining only takes back sections that went offline
+ * before: the pool never grows beyond the ranges it was booted with, and
+ * hpa_nr_pages, the span the hugepages are numbered in, never changes.
+ */
+static DEFINE_MUTEX(hpa_resize_mutex);
+
+/* node gained or lost nr_pages hugepages, caller holds hpa_resize_mutex */
+static void hpa_resize_account(struct hpa_node *node, long nr_pages)
+{
+    node->node_present_pages += nr_pages;
+    total_page += nr_pages;
+    hpa_node_set_watermarks(node);
+    if (node->pcp)
+        node->stat_threshold = hpa_stat_threshold(node);
+}
+
+/* number of the first hugepage of section, its pages number on from it */
+static unsigned long hpa_section_first_nr(struct hpa_section *section)
+{
+    struct hpa_range *r = hpa_pfn_range(section->start_pfn);
+
+    BUG_ON(!r);
+    return r->first + ((section->start_pfn - r->start_pfn) >> 9);
+}
+
+static int __hpa_offline_section(int nid, unsigned long pnum)
+{
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    struct hpa_section *section = &hpa_section_array[nid][pnum];
+    unsigned long nr_pages = section->nr_pages;
+    unsigned long start_pfn = section->start_pfn;
+    unsigned long flags;
+    int ret = -EBUSY;
+
+    if (section->state & HPA_SECTION_OFFLINE)
+        return 0;
+    /* no struct page or zone for the buddy allocator to take it with */
+    if (!pfn_valid(start_pfn))
+        return -EOPNOTSUPP;
+
+    /* the section's pages may be parked in pcp or zeroed lists */
+    hpa_drain_all_pages();
+    hpa_unzero_section(node, section);
+
+    local_irq_save(flags);
+    spin_lock(&section->lock);
+    if (section->nr_free == nr_pages) {
+        INIT_LIST_HEAD(&section->free_list);
+        bitmap_clear(section->free_map, 0, nr_pages);
+        section->nr_free = 0;
+        section->max_run = 0;
+        hpa_section_set_class(node, section);
+        clear_bit(pnum, node->section_map);
+        atomic_long_dec(&node->nr_free_sections);
+        section->state |= HPA_SECTION_OFFLINE;
+        ret = 0;
     }
+    spin_unlock(&section->lock);
+    if (!ret)
+        node_page_state_add(-nr_pages, node, NR_FREE_PAGES);
+    local_irq_restore(flags);
+    if (ret)
+        return ret;
+
+    hpa_resize_account(node, -(long)nr_pages);
+    if (!node->node_present_pages)
+        clear_bit(nid, &hpnode_mask);
+    /* hpa_pfn_to_page and is_hpa_pfn no longer claim these pfns */
+    bitmap_set(hpa_offline_map, hpa_section_first_nr(section), nr_pages);
+
+#ifdef CONFIG_CMA
+    if (section->state & HPA_SECTION_BORROWED) {
+        /* counted out of MemTotal by __hpa_online_section */
+        free_contig_range(start_pfn, nr_pages << 9);
+        adjust_managed_page_count(pfn_to_page(start_pfn), nr_pages << 9);
+        section->state &= ~HPA_SECTION_BORROWED;
+    } else
+#endif
+        free_reserved_area(__va(HPA_PFN_PHYS(start_pfn)),
+                           __va(HPA_PFN_PHYS(start_pfn + (nr_pages << 9))),
+                           -1, NULL);
+    pr_info("hpa: node %d: section %lu offline, %lu hugepages returned\n",
+            nid, pnum, nr_pages);
+    return 0;
+}
+
+static int __hpa_online_section(int nid, unsigned long pnum)
+{
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    struct hpa_section *section = &hpa_section_array[nid][pnum];
+    unsigned long nr_pages = section->nr_pages;
+    int ret;
+
+    if (!(section->state & HPA_SECTION_OFFLINE))
+        return 0;
+#ifdef CONFIG_CMA
+    ret = alloc_contig_range(section->start_pfn,
+                             section->start_pfn + (nr_pages << 9), MIGRATE_MOVABLE);
+    if (ret)
+        return ret;
+    /* free_reserved_area counted these in, they are HPA memory again */
+    adjust_managed_page_count(pfn_to_page(section->start_pfn),
+                              -(long)(nr_pages << 9));
+#else
+    return -EOPNOTSUPP;
+#endif
+    bitmap_clear(hpa_offline_map, hpa_section_first_nr(section), nr_pages);
+    section->state = HPA_SECTION_BORROWED;
+    hpa_resize_account(node, nr_pages);
+    set_bit(nid, &hpnode_mask);
+    /* the memmap is still set up, this only refills the free list */
+    hpa_init_node_sections(nid, pnum, pnum + 1);
+    pr_info("hpa: node %d: section %lu online, %lu hugepages added\n",
+            nid, pnum, nr_pages);
     return 0;
 }
 
+static bool hpa_resize_valid(int nid, unsigned long pnum)
+{
+    return nid >= 0 && nid < BITS_PER_LONG && nid < MAX_NUMNODES &&
+           HPA_NODE_DATA(nid) &&
+           hpa_section_array[nid] && pnum < HPA_NODE_DATA(nid)->node_max_sections;
+}
+
+/* give section pnum of node nid back to the buddy allocator, may sleep */
+int hpa_offline_section(int nid, unsigned long pnum)
+{
+    int ret;
+
+    if (!hpa_resize_valid(nid, pnum))
+        return -EINVAL;
+    /* deferred init may still be filling the section */
+    wait_for_completion(&hpa_init_done);
+    mutex_lock(&hpa_resize_mutex);
+    ret = __hpa_offline_section(nid, pnum);
+    mutex_unlock(&hpa_resize_mutex);
+    return ret;
+}
+EXPORT_SYMBOL(hpa_offline_section);
+
+/* take an offline section of node nid back into the pool, may sleep */
+int hpa_online_section(int nid, unsigned long pnum)
+{
+    int ret;
+
+    if (!hpa_resize_valid(nid, pnum))
+        return -EINVAL;
+    wait_for_completion(&hpa_init_done);
+    mutex_lock(&hpa_resize_mutex);
+    ret = __hpa_online_section(nid, pnum);
+    mutex_unlock(&hpa_resize_mutex);
+    return ret;
+}
+EXPORT_SYMBOL(hpa_online_section);
+
+/*
+ * Offline or online sections of node nid until nr_online of them are in
+ * the pool. Sections go offline from the top, skipping busy ones, and come
+ * back from the bottom. Returns the number now online, or the last error
+ * if nr_online could not be reached.
+ */
+long hpa_resize_node(int nid, unsigned long nr_online)
+{
+    struct hpa_node *node;
+    unsigned long pnum, online = 0;
+    int ret = 0;
+
+    if (!hpa_resize_valid(nid, 0))
+        return -EINVAL;
+    node = HPA_NODE_DATA(nid);
+    nr_online = min(nr_online, node->node_max_sections);
+    wait_for_completion(&hpa_init_done);
+
+    mutex_lock(&hpa_resize_mutex);
+    for (pnum = 0; pnum < node->node_max_sections; pnum++)
+        if (!(hpa_section_array[nid][pnum].state & HPA_SECTION_OFFLINE))
+            online++;
+
+    for (pnum = node->node_max_sections; pnum-- > 0 && online > nr_online; ) {
+        if (hpa_section_array[nid][pnum].state & HPA_SECTION_OFFLINE)
+            continue;
+        ret = __hpa_offline_section(nid, pnum);
+        if (!ret)
+            online--;
+    }
+    for (pnum = 0; pnum < node->node_max_sections && online < nr_online; pnum++) {
+        if (!(hpa_section_array[nid][pnum].state & HPA_SECTION_OFFLINE))
+            continue;
+        ret = __hpa_online_section(nid, pnum);
+        if (ret)
+            break;
+        online++;
+    }
+    mutex_unlock(&hpa_resize_mutex);
+
+    return online == nr_online || !ret ? (long)online : (long)ret;
+}
+EXPORT_SYMBOL(hpa_resize_node);
+
+/*
+ * /sys/devices/system/node/nodeN/hpa_sections: reads as the online and
+ * total section counts, a number written resizes the node to it.
+ */
+static ssize_t hpa_sections_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct hpa_node *node = HPA_NODE_DATA(dev->id);
+    unsigned long pnum, online = 0;
+
+    for (pnum = 0; pnum < node->node_max_sections; pnum++)
+        if (!(ACCESS_ONCE(hpa_section_array[dev->id][pnum].state) & HPA_SECTION_OFFLINE))
+            online++;
+    return sprintf(buf, "%lu %lu\n", online, node->node_max_sections);
+}
+
+static ssize_t hpa_sections_store(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
+{
+    unsigned long nr;
+    long ret;
+
+    ret = kstrtoul(buf, 0, &nr);
+    if (ret)
+        return ret;
+    ret = hpa_resize_node(dev->id, nr);
+    if (ret < 0)
+        return ret;
+    return (unsigned long)ret == nr ? count : -EBUSY;
+}
+static DEVICE_ATTR(hpa_sections, S_IRUGO | S_IWUSR, hpa_sections_show,
+                   hpa_sections_store);
+
+static int __init hpa_resize_init(void)
+{
+    int nid;
+
+    for_each_huge_node(nid, HPNODE_MASK) {
+        if (!hpa_section_array[nid] || !node_devices[nid])
+            continue;
+        if (device_create_file(&node_devices[nid]->dev, &dev_attr_hpa_sections))
+            pr_err("hpa: cannot create hpa_sections for node %d\n", nid);
+    }
+    return 0;
+}
+module_init(hpa_resize_init);
+
+/*
+ * Called for each memory block of node nid once the ranges are set. The
+ * node spans from the first to the last hugepage of any range inside its
+ * blocks; the holes in between are skipped when sections are cut.
+ */
 void hpa_node_start_end_init(int nid, u64 start, u64 end)
 {
 	unsigned long addr1 = start >> 12, addr2 = end >> 12;
-	hpa_node_start[nid]=hpa_start_pfn>addr1?hpa_start_pfn:addr1;
-	hpa_node_end[nid]=hpa_start_pfn+(hpa_nr_pages<<9)<addr2?hpa_start_pfn+(hpa_nr_pages<<9):addr2;
-	if(hpa_node_start[nid]<hpa_node_end[nid]) {
-		hpnode_mask|=1UL<<nid;
+	unsigned long start_pfn = ULONG_MAX, end_pfn = 0;
+	int i;
+
+	for (i = 0; i < hpa_nr_ranges; i++) {
+		if (hpa_ranges[i].end_pfn <= addr1 || hpa_ranges[i].start_pfn >= addr2)
+			continue;
+		start_pfn = min(start_pfn, max(hpa_ranges[i].start_pfn, addr1));
+		end_pfn = max(end_pfn, min(hpa_ranges[i].end_pfn, addr2));
+	}
+	if (start_pfn >= end_pfn)
+		return;
+	if ((1UL<<nid)&hpnode_mask) {
+		start_pfn = min(start_pfn, hpa_node_start[nid]);
+		end_pfn = max(end_pfn, hpa_node_end[nid]);
 	}
+	hpa_node_start[nid] = start_pfn;
+	hpa_node_end[nid] = end_pfn;
+	hpnode_mask|=1UL<<nid;
 }
 
+/*
+ * Add [start_at, start_at + mem_size) to the pool, may be called once per
+ * reserved range. Ranges are kept sorted and hugepage numbers follow.
+ */
 void hpa_start_nr_set(u64 start_at, u64 mem_size)
 {
-	hpa_start_pfn = start_at >> 12;
-	hpa_nr_pages = mem_size >> 21;
-	hpa_end_pfn = hpa_start_pfn + (hpa_nr_pages << 9);
-	total_page += hpa_nr_pages;
+	unsigned long start_pfn = start_at >> 12;
+	unsigned long nr_pages = mem_size >> 21;
+	unsigned long end_pfn = start_pfn + (nr_pages << 9);
+	unsigned long first = 0;
+	int i, pos;
+
+	if (!nr_pages)
+		return;
+	if (hpa_nr_ranges == HPA_MAX_RANGES) {
+		pr_err("hpa: too many ranges, ignoring %#llx-%#llx\n",
+		       start_at, start_at + mem_size);
+		return;
+	}
+	for (pos = 0; pos < hpa_nr_ranges; pos++) {
+		if (start_pfn < hpa_ranges[pos].end_pfn && end_pfn > hpa_ranges[pos].start_pfn) {
+			pr_err("hpa: range %#llx-%#llx overlaps, ignoring it\n",
+			       start_at, start_at + mem_size);
+			return;
+		}
+		if (start_pfn < hpa_ranges[pos].start_pfn)
+			break;
+	}
+	memmove(&hpa_ranges[pos + 1], &hpa_ranges[pos],
+		(hpa_nr_ranges - pos) * sizeof(struct hpa_range));
+	hpa_ranges[pos].start_pfn = start_pfn;
+	hpa_ranges[pos].end_pfn = end_pfn;
+	hpa_nr_ranges++;
+
+	for (i = 0; i < hpa_nr_ranges; i++) {
+		hpa_ranges[i].first = first;
+		first += hpa_range_pages(&hpa_ranges[i]);
+	}
+	hpa_start_pfn = hpa_ranges[0].start_pfn;
+	hpa_end_pfn = hpa_ranges[hpa_nr_ranges - 1].end_pfn;
+	hpa_nr_pages = first;
+	total_page += nr_pages;
+}
+
+/* insert a range boundary at pfn if it falls inside range i */
+static void __init hpa_split_range(int i, unsigned long pfn)
+{
+	if (pfn <= hpa_ranges[i].start_pfn || pfn >= hpa_ranges[i].end_pfn)
+		return;
+	if (hpa_nr_ranges == HPA_MAX_RANGES) {
+		pr_warn("hpa: too many ranges to split at node boundary %#lx\n", pfn);
+		return;
+	}
+	memmove(&hpa_ranges[i + 1], &hpa_ranges[i],
+		(hpa_nr_ranges - i) * sizeof(struct hpa_range));
+	hpa_ranges[i].end_pfn = pfn;
+	hpa_ranges[i + 1].start_pfn = pfn;
+	hpa_ranges[i + 1].first = hpa_ranges[i].first + hpa_range_pages(&hpa_ranges[i]);
+	hpa_nr_ranges++;
+}
+
+/*
+ * Cut ranges at node boundaries so each one, and the memmap chunk
+ * allocated for it, belongs to a single node. Numbering is unchanged.
+ */
+static void __init hpa_split_ranges_by_node(void)
+{
+	int i, nid;
+
+	for (i = 0; i < hpa_nr_ranges; i++) {
+		for_each_huge_node(nid, HPNODE_MASK) {
+			hpa_split_range(i, hpa_node_start[nid]);
+			hpa_split_range(i, hpa_node_end[nid]);
+		}
+		hpa_ranges[i].nid = NUMA_NO_NODE;
+		for_each_huge_node(nid, HPNODE_MASK) {
+			if (hpa_ranges[i].start_pfn >= hpa_node_start[nid] &&
+			    hpa_ranges[i].start_pfn < hpa_node_end[nid]) {
+				hpa_ranges[i].nid = nid;
+				break;
+			}
+		}
+	}
+}
+
+/* the layout assumptions of struct hugepage and struct hpa_node */
+static void __init hpa_check_layout(void)
+{
+	/* struct hugepage is passed off as struct page */
+	BUILD_BUG_ON(offsetof(struct hugepage, flags) != offsetof(struct page, flags));
+	BUILD_BUG_ON(offsetof(struct hugepage, mapping) != offsetof(struct page, mapping));
+	BUILD_BUG_ON(offsetof(struct hugepage, index) != offsetof(struct page, index));
+	BUILD_BUG_ON(offsetof(struct hugepage, _mapcount) != offsetof(struct page, _mapcount));
+	BUILD_BUG_ON(offsetof(struct hugepage, lru) != offsetof(struct page, lru));
+	BUILD_BUG_ON(offsetof(struct hugepage, private) != offsetof(struct page, private));
+	/* hot fields in the first 64 bytes */
+	BUILD_BUG_ON(offsetof(struct hugepage, range) + sizeof(unsigned int) > 64);
+	BUILD_BUG_ON(sizeof(struct hugepage) % sizeof(unsigned long));
+	/* a class for every fls(nr_free) of the largest section */
+	BUILD_BUG_ON(HPA_PACK_CLASSES < HPA_SECTION_SHIFT_MAX + 2);
+	BUILD_BUG_ON(HPA_PACK_CLASSES > BITS_PER_LONG);
+
+#ifdef CONFIG_SMP
+	/* written groups do not share a line with anything else */
+	BUILD_BUG_ON(offsetof(struct hpa_node, next_nr_section) % SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct hpa_node, lru_lock) % SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct hpa_node, vm_stat) % SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct hpa_node, zero_lock) % SMP_CACHE_BYTES);
+	BUILD_BUG_ON(sizeof(struct hpa_node) % SMP_CACHE_BYTES);
+#endif
 }
 
 int __init hpa_init(void)
 {
 	int ret = 0;
-	unsigned long size;
-	total_page = 0;
-	free_page = 0;
-	/*start_pfn and size should be get dynamically */
-	size = PAGE_ALIGN(sizeof(struct hugepage)* hpa_nr_pages);
+	unsigned long size, j;
+	struct hpa_range *r;
+	int i;
 
-	huge_mem_map = alloc_bootmem(size);
+	hpa_check_layout();
+	hpa_split_ranges_by_node();
+	/* a memmap per range on its own node, nothing is spent on the holes */
+	for (i = 0; i < hpa_nr_ranges; i++) {
+		r = &hpa_ranges[i];
+		size = PAGE_ALIGN(sizeof(struct hugepage) * hpa_range_pages(r));
+		if (r->nid != NUMA_NO_NODE)
+			r->mem_map = hpa_alloc_bootmem_node(r->nid, size);
+		else
+			r->mem_map = alloc_bootmem(size);
+		/* hpa_page_to_pfn and hpa_page_range go by it, before any init */
+		for (j = 0; j < hpa_range_pages(r); j++)
+			r->mem_map[j].range = i;
+		if (!hpa_memmap_start || r->mem_map < hpa_memmap_start)
+			hpa_memmap_start = r->mem_map;
+		if (r->mem_map + hpa_range_pages(r) > hpa_memmap_end)
+			hpa_memmap_end = r->mem_map + hpa_range_pages(r);
+	}
+	huge_mem_map = hpa_ranges[0].mem_map;
+	if (hpa_nr_pages)
+		hpa_offline_map = alloc_bootmem(BITS_TO_LONGS(hpa_nr_pages) * sizeof(long));
 
 	hpa_nodes_init();
 
-	hpa_free_all_boot_hugepages();
-
 	return ret;
 }
 
+static int hpa_cpu_callback(struct notifier_block *nfb,
+        unsigned long action, void *hcpu)
+{
+    int cpu = (unsigned long)hcpu;
+
+    if (action == CPU_DEAD || action == CPU_DEAD_FROZEN) {
+        hpa_drain_pages(cpu);
+        hpa_fold_cpu_stats(cpu);
+    }
+    return NOTIFY_OK;
+}
+
+/* percpu allocator is not up yet at hpa_init time */
+static int __init hpa_pcp_init(void)
+{
+    struct hpa_pcp __percpu *pcp;
+    int nid, cpu;
+
+    for_each_huge_node(nid, HPNODE_MASK) {
+        /* percpu memory comes zeroed, so are the counts and stat deltas */
+        pcp = alloc_percpu(struct hpa_pcp);
+        if (!pcp) {
+            pr_err("hpa: cannot allocate pcp lists for node %d\n", nid);
+            continue;
+        }
+        for_each_possible_cpu(cpu)
+            INIT_LIST_HEAD(&per_cpu_ptr(pcp, cpu)->list);
+        HPA_NODE_DATA(nid)->stat_threshold = hpa_stat_threshold(HPA_NODE_DATA(nid));
+        smp_wmb();
+        HPA_NODE_DATA(nid)->pcp = pcp;
+    }
+    hotcpu_notifier(hpa_cpu_callback, 0);
+    return 0;
+}
+core_initcall(hpa_pcp_init);
+
 void hp_del_page_from_lru_list(struct hugepage *hpage,
                                 struct lruvec *lruvec, enum lru_list lru)
 {   
@@ -11,7 +11,16 @@
 #include <linux/mmzone.h>
 #include <linux/kernel.h>
 #include <linux/sched.h>
-
+#include <linux/percpu.h>
+#include <linux/bitmap.h>
+#include <linux/cache.h>
+
+/*
+ * Cast to struct page by the page cache and rmap code, so the fields up
+ * to private sit where struct page has them, see hpa_check_layout. Those,
+ * section and range fill the first 64 bytes; the rarely used tail comes
+ * after.
+ */
 struct hugepage
 {
     /* First double word block */
@@ -27,6 +36,12 @@ struct hugepage
     struct list_head lru;
     /* Remainder is not double word aligned */
     unsigned long private;
+    /* index in hpa_section_array of its node, too wide for page flags */
+    unsigned int section;
+    /* index in hpa_ranges, set for every page at boot */
+    unsigned int range;
+
+    /* cold from here on */
 #if defined(WANT_PAGE_VIRTUAL)
     void *virtual;
 #endif /* WANT_PAGE_VIRTUAL */
@@ -35,10 +50,41 @@ struct hugepage
 //#endif
 };
 
+/* per-node events, counted per cpu and summed over all cpus when read */
+enum hpa_event_item {
+    HPA_ALLOC,              /* pages handed out by the node */
+    HPA_ALLOC_EMPTY,        /* allocations that found the node empty */
+    HPA_ALLOC_FAIL,         /* allocations that failed everywhere, by preferred node */
+    HPA_FREE,               /* pages given back to the node */
+    HPA_ZEROED_HIT,         /* faults that found the page already cleared */
+    HPA_ZEROED_MISS,        /* faults that had to clear the page */
+    NR_HPA_EVENT_ITEMS
+};
 
+/* per-cpu cache of free hugepages, one per cpu for every hpa_node */
+struct hpa_pcp
+{
+    int count;              /* number of pages in the list */
+    struct list_head list;
+    /* vm_stat deltas not yet folded into the node, see node_page_state_add */
+    s8 vm_stat_diff[NR_VM_ZONE_STAT_ITEMS];
+    unsigned long events[NR_HPA_EVENT_ITEMS];
+};
+
+/*
+ * Sections with free pages are kept on lists by fill class, fls(nr_free),
+ * so the fullest non-full one is found in O(1). One class per power of
+ * two up to the largest section, class 0 (no free page) is not listed.
+ */
+#define HPA_PACK_CLASSES    18
+
+/*
+ * Fields are grouped by who writes them, each written group on cache
+ * lines of its own so CPUs faulting on a node do not false-share.
+ */
 struct hpa_node
 {
-    /* below shouln't change after init */
+    /* below shouln't change after init, or only on resize */
     
     /* for struct hpa_section */
     /*
@@ -51,20 +97,46 @@ struct hpa_node
     unsigned long node_max_sections;
 
     int node_id;
+    int nid;
 
-    unsigned long next_nr_section;
+    /* bit set for every section whose free list is non-empty */
+    unsigned long *section_map;
     
-    wait_queue_head_t waitq;
+    /* page lock waitqueues, hashed by struct hugepage address */
+    wait_queue_head_t *wait_table;
+    unsigned int wait_table_bits;
     
+    int stat_threshold;     /* largest per-cpu vm_stat delta */
+    unsigned long  watermark;       /* hp_kswapd starts below this */
+    unsigned long  watermark_high;  /* and stops at this */
+    struct task_struct *hp_kswapd;    
+    wait_queue_head_t kswapd_wait;
 
-    int nid;
+    /* allocated by hpa_pcp_init, NULL until then */
+    struct hpa_pcp __percpu *pcp;
+
+    /* section selection, written on every refill of a pcp list */
+    unsigned long next_nr_section ____cacheline_aligned_in_smp;
+    atomic_long_t nr_free_sections;
+    /* protects pack_mask, pack_lists and the sections' pack_node */
+    spinlock_t pack_lock;
+    unsigned long pack_mask;    /* bit set for every non-empty pack list */
+    struct list_head pack_lists[HPA_PACK_CLASSES];
+
+    /* LRU, written on every fault and by reclaim */
+    spinlock_t lru_lock ____cacheline_aligned_in_smp;
     int all_unreclaimable;
-    spinlock_t lru_lock;
     unsigned long pages_scanned;
     struct lruvec lruvec;
-    atomic_long_t vm_stat[NR_VM_ZONE_STAT_ITEMS];
-    unsigned long  watermark;
-    struct task_struct *hp_kswapd;    
+
+    /* counters, folded in from the pcp deltas */
+    atomic_long_t vm_stat[NR_VM_ZONE_STAT_ITEMS] ____cacheline_aligned_in_smp;
+
+    /* free pages already cleared by hp_zerod */
+    spinlock_t zero_lock ____cacheline_aligned_in_smp;
+    struct list_head zeroed_list;
+    unsigned long nr_zeroed;
+    struct task_struct *hp_zerod;
 
 };
 
@@ -99,17 +171,62 @@ enum page_references{
 	PAGEREF_ACTIVATE,
 };
 
+/* padded so that cpus working on different sections do not share lines */
 struct hpa_section
 {
+    spinlock_t lock;        /* protects free_list, nr_free and free_map */
+    unsigned int state;     /* HPA_SECTION_*, changed under hpa_resize_mutex */
     struct list_head free_list;
-    struct list_head section_node;
+    unsigned long nr_free;
+    /* bit per page of the section, set while it is on free_list */
+    unsigned long *free_map;
+    /* a section never crosses a range, so its pages are contiguous */
+    unsigned long start_pfn;
+    unsigned long nr_pages;
+    /* on node->pack_lists[pack_class], see hpa_section_set_class */
+    struct list_head pack_node;
+    unsigned int pack_class;
+    /* no run of set free_map bits is longer, see hpa_section_note_free */
+    unsigned int max_run;
+} ____cacheline_aligned_in_smp;
+
+/* given back to the buddy allocator by hpa_offline_section */
+#define HPA_SECTION_OFFLINE     0x1
+/* memory taken from the buddy allocator by hpa_online_section */
+#define HPA_SECTION_BORROWED    0x2
+
+/*
+ * The pool is made of up to HPA_MAX_RANGES discontiguous pfn ranges, kept
+ * sorted by address, each with a memmap of its own. Hugepages are also
+ * numbered from 0 to hpa_nr_pages across the ranges in address order.
+ * hpa_init splits ranges at node boundaries, so the table leaves room.
+ */
+#define HPA_MAX_RANGES  16
+
+struct hpa_range
+{
+    unsigned long start_pfn;
+    unsigned long end_pfn;
+    unsigned long first;        /* number of its first hugepage */
+    struct hugepage *mem_map;   /* allocated on node nid */
+    int nid;
 };
 
+extern struct hpa_range hpa_ranges[HPA_MAX_RANGES];
+extern int hpa_nr_ranges;
+/* bit per hugepage number, set while its section is offline */
+extern unsigned long *hpa_offline_map;
+/* memmap of the first range */
 extern struct hugepage *huge_mem_map;
+/* lowest and end of the highest memmap of any range */
+extern struct hugepage *hpa_memmap_start;
+extern struct hugepage *hpa_memmap_end;
 extern struct hpa_node *hpa_node_data[MAX_NUMNODES];
 extern struct hpa_section *hpa_section_array[MAX_NUMNODES];
 extern unsigned long total_page;
+/* deprecated, use hpa_nr_free_pages(); kept for out-of-tree users */
 extern unsigned long free_page;
+/* lowest and highest pfn of any range, and the pages of all of them */
 extern unsigned long hpa_start_pfn;
 extern unsigned long hpa_nr_pages;
 extern unsigned long hpa_end_pfn;
@@ -122,29 +239,231 @@ extern unsigned long hpnode_mask;
 #define HPA_NODE_DATA(nid)  (hpa_node_data[(nid)])
 
 #define for_each_huge_node(node,mask) for_each_node_mask(node, node_possible_map) if((1UL<<node)& HPNODE_MASK)
-/* We need to alloc one page to hold section, number of seciton
- * should be PAGE_SIZE / sizeof( struct hpa_section )
- * */
-#define MAX_NUMSECTION  (PAGE_SIZE/ sizeof(struct hpa_section))
-#define hpa_pfn_to_page(pfn)    (huge_mem_map + ((pfn - hpa_start_pfn) >> 9))
-#define hpa_page_to_pfn(page)   (hpa_start_pfn + ((page - huge_mem_map) << 9))
-
-#define SECTION_SHIFT   11
-#define SECTION_SIZE    (1 << SECTION_SHIFT)
+
+static inline unsigned long hpa_range_pages(const struct hpa_range *r)
+{
+    return (r->end_pfn - r->start_pfn) >> 9;
+}
+
+/*
+ * Pfns outside the pool's overall span are rejected without a walk, the
+ * walk is over at most HPA_MAX_RANGES entries.
+ */
+static inline struct hpa_range *hpa_pfn_range(unsigned long pfn)
+{
+    int i;
+
+    if (pfn < hpa_start_pfn || pfn >= hpa_end_pfn)
+        return NULL;
+    for (i = 0; i < hpa_nr_ranges; i++)
+        if (pfn >= hpa_ranges[i].start_pfn && pfn < hpa_ranges[i].end_pfn)
+            return &hpa_ranges[i];
+    return NULL;
+}
+
+/*
+ * NULL for anything that is not a pool page. page->range is only trusted
+ * once page is known to lie in that range's memmap, so this is O(1) and
+ * safe on any struct page; most of them fail the first test.
+ */
+static inline struct hpa_range *hpa_page_range(const struct hugepage *page)
+{
+    struct hpa_range *r;
+    unsigned int i;
+
+    if (page < hpa_memmap_start || page >= hpa_memmap_end)
+        return NULL;
+    i = ACCESS_ONCE(page->range);
+    if (i >= hpa_nr_ranges)
+        return NULL;
+    r = &hpa_ranges[i];
+    if (page < r->mem_map || page >= r->mem_map + hpa_range_pages(r))
+        return NULL;
+    return r;
+}
+
+/* NULL for a pfn outside the pool or in a section given to the buddy */
+static inline struct hugepage *hpa_pfn_to_page(unsigned long pfn)
+{
+    struct hpa_range *r = hpa_pfn_range(pfn);
+    unsigned long idx;
+
+    if (!r)
+        return NULL;
+    idx = (pfn - r->start_pfn) >> 9;
+    if (hpa_offline_map && test_bit(r->first + idx, hpa_offline_map))
+        return NULL;
+    return r->mem_map + idx;
+}
+
+/* page must be in the pool, see is_hpa_page; no lookup, no walk */
+static inline unsigned long hpa_page_to_pfn(const struct hugepage *page)
+{
+    struct hpa_range *r = &hpa_ranges[page->range];
+
+    VM_BUG_ON(hpa_page_range(page) != r);
+    return r->start_pfn + ((page - r->mem_map) << 9);
+}
+
+static inline unsigned long hpa_page_nr(const struct hugepage *page)
+{
+    struct hpa_range *r = &hpa_ranges[page->range];
+
+    VM_BUG_ON(hpa_page_range(page) != r);
+    return r->first + (page - r->mem_map);
+}
+
+static inline struct hugepage *hpa_nr_to_page(unsigned long nr)
+{
+    int i;
+
+    for (i = 0; i < hpa_nr_ranges; i++)
+        if (nr < hpa_ranges[i].first + hpa_range_pages(&hpa_ranges[i]))
+            return hpa_ranges[i].mem_map + (nr - hpa_ranges[i].first);
+    return NULL;
+}
+
+/* most pages handled per lock hold by the bulk interfaces */
+#define HPA_BULK_BATCH  64
+
+/*
+ * Hugepages per section, as a shift. Set at boot by hpa_section_size=,
+ * 4GB sections by default.
+ */
+#define HPA_SECTION_SHIFT_DEFAULT   11
+#define HPA_SECTION_SHIFT_MIN       9       /* 1GB, room for a 1GB contig run */
+#define HPA_SECTION_SHIFT_MAX       16      /* 128GB */
+extern unsigned int hpa_section_shift;
+#define SECTION_SHIFT   hpa_section_shift
+#define SECTION_SIZE    (1UL << SECTION_SHIFT)
 #define HPA_PFN_PHYS(x)    ((phys_addr_t)(x) << 12)
 
+static inline bool is_hpa_node(int nid)
+{
+    return nid >= 0 && nid < BITS_PER_LONG && ((1UL << nid) & HPNODE_MASK);
+}
+
 bool is_hpa_pfn(unsigned long pfn);
 bool is_hpa_page(struct page* page);
+unsigned long hpa_nr_free_pages(void);
 int hpa_init(void);
 void hpa_free_page(struct hugepage *page);
 void hpa_free_page_list(struct list_head *list);
 void __hpa_free_page(struct hugepage *page);
+void hpa_drain_local_pages(void *arg);
+void hpa_drain_all_pages(void);
 struct hugepage *hpa_alloc_page_node(int nid);
 struct hugepage *hpa_alloc_page(void);
+struct hugepage *hpa_alloc_page_nodemask(int preferred_nid, nodemask_t *nodemask);
+/* may sleep in direct reclaim, the allocators above never do */
+struct hugepage *hpa_alloc_page_reclaim(int preferred_nid, nodemask_t *nodemask);
+struct hugepage *hpa_alloc_page_vma(struct vm_area_struct *vma, unsigned long address);
+int hpa_alloc_pages_bulk(int nid, int nr, struct hugepage **pages);
+struct hugepage *hpa_alloc_contig_pages(int nid, int nr, int align);
+void hpa_free_contig_pages(struct hugepage *page, int nr);
+void hpa_free_pages_bulk(struct hugepage **pages, int nr);
 int hpa_set_page_dirty(struct hugepage *page);
 void hpa_put_page(struct hugepage *page);
 void hpa_node_start_end_init(int nid, u64 start, u64 end);
 void hpa_start_nr_set(u64 start_at, u64 mem_size);
+int hpa_offline_section(int nid, unsigned long pnum);
+int hpa_online_section(int nid, unsigned long pnum);
+long hpa_resize_node(int nid, unsigned long nr_online);
+
+/*
+ * Set on a page taken from the zeroed list, which only hpa_alloc_page_vma
+ * does. Cleared again by the first hpa_clear_huge_page, by the other
+ * allocators and whenever the page is freed. The owner flag is
+ * free for us to use while the page is not in a filesystem's hands.
+ */
+#define PG_hpa_zeroed   PG_owner_priv_1
+
+static inline int HpaPageZeroed(struct hugepage *page)
+{
+    return test_bit(PG_hpa_zeroed, &page->flags);
+}
+
+static inline void SetHpaPageZeroed(struct hugepage *page)
+{
+    set_bit(PG_hpa_zeroed, &page->flags);
+}
+
+static inline void ClearHpaPageZeroed(struct hugepage *page)
+{
+    clear_bit(PG_hpa_zeroed, &page->flags);
+}
+
+static inline int TestClearHpaPageZeroed(struct hugepage *page)
+{
+    return test_and_clear_bit(PG_hpa_zeroed, &page->flags);
+}
+
+/*
+ * Set while someone may be sleeping on the page lock, so an uncontended
+ * hpa_unlock_page can skip the waitqueue. Hugepages never go to fscache.
+ */
+#define PG_hpa_waiters  PG_private_2
+
+static inline int HpaPageWaiters(struct hugepage *page)
+{
+    return test_bit(PG_hpa_waiters, &page->flags);
+}
+
+static inline void SetHpaPageWaiters(struct hugepage *page)
+{
+    set_bit(PG_hpa_waiters, &page->flags);
+}
+
+static inline void ClearHpaPageWaiters(struct hugepage *page)
+{
+    clear_bit(PG_hpa_waiters, &page->flags);
+}
+
+/*
+ * Idle tracking, one bit per hugepage indexed by hpa_page_nr. Idle is
+ * set from userspace through /sys/kernel/mm/hpa_idle/bitmap and cleared
+ * once a pte is found young; young remembers for reclaim a young pte bit
+ * the idle scan cleared. Both are NULL until hpa_idle_init.
+ */
+extern unsigned long *hpa_idle_map;
+extern unsigned long *hpa_young_map;
+
+static inline bool hpa_page_is_idle(struct hugepage *page)
+{
+    return hpa_idle_map && test_bit(hpa_page_nr(page), hpa_idle_map);
+}
+
+static inline void hpa_set_page_idle(struct hugepage *page)
+{
+    if (hpa_idle_map)
+        set_bit(hpa_page_nr(page), hpa_idle_map);
+}
+
+static inline void hpa_clear_page_idle(struct hugepage *page)
+{
+    if (hpa_idle_map && test_bit(hpa_page_nr(page), hpa_idle_map))
+        clear_bit(hpa_page_nr(page), hpa_idle_map);
+}
+
+static inline void hpa_set_page_young(struct hugepage *page)
+{
+    if (hpa_young_map)
+        set_bit(hpa_page_nr(page), hpa_young_map);
+}
+
+static inline bool hpa_test_and_clear_page_young(struct hugepage *page)
+{
+    if (!hpa_young_map || !test_bit(hpa_page_nr(page), hpa_young_map))
+        return false;
+    return test_and_clear_bit(hpa_page_nr(page), hpa_young_map);
+}
+
+/* a freed page starts its next life neither idle nor young */
+static inline void hpa_reset_page_idle(struct hugepage *page)
+{
+    hpa_clear_page_idle(page);
+    hpa_test_and_clear_page_young(page);
+}
 
 static inline void hpa_set_page_node(struct hugepage *page,unsigned long node)
 {
@@ -152,10 +471,9 @@ static inline void hpa_set_page_node(struct hugepage *page,unsigned long node)
     page->flags |= (node & NODES_MASK) << NODES_PGSHIFT;
 }
 
-static inline void hpa_set_page_section(struct hugepage *page,unsigned long section)
+static inline void hpa_set_page_section(struct hugepage *page,unsigned int section)
 {
-    page->flags &= ~(SECTIONS_MASK << SECTIONS_PGSHIFT);
-    page->flags |= (section & SECTIONS_MASK) << SECTIONS_PGSHIFT; 
+    page->section = section;
 }
 static inline int hpa_page_to_nid(const struct hugepage *page)
 {
@@ -164,8 +482,7 @@ static inline int hpa_page_to_nid(const struct hugepage *page)
 
 static inline struct hpa_section *hpa_page_section(const struct hugepage *page)
 {
-    unsigned long section = (page->flags >> SECTIONS_PGSHIFT) & SECTIONS_MASK;
-    return hpa_section_array[hpa_page_to_nid(page)] + section;
+    return hpa_section_array[hpa_page_to_nid(page)] + page->section;
 }
 
 static inline void *hpa_page_address(const struct hugepage *page)
@@ -200,10 +517,18 @@ static inline void hpa_lock_page(struct hugepage *page)
 }
 
 
+struct hugepage *hpa_find_get_page(struct address_space *mapping, pgoff_t offset);
 struct hugepage *hpa_find_lock_page(struct address_space *mapping, pgoff_t offset);
+unsigned hpa_find_get_pages(struct address_space *mapping, pgoff_t start,
+                            unsigned int nr_pages, struct hugepage **pages);
+unsigned hpa_find_get_pages_range(struct address_space *mapping, pgoff_t *start,
+                                  pgoff_t end, unsigned int nr_pages,
+                                  struct hugepage **pages);
 
 
 int hpa_add_to_page_cache(struct hugepage *page, struct address_space *mapping, pgoff_t idx);
+int hpa_add_to_page_cache_range(struct address_space *mapping, pgoff_t start,
+        struct hugepage **pages, int nr);
 
 void __hpa_delete_from_page_cache(struct hugepage *page);
 
@@ -212,17 +537,91 @@ void hpa_delete_from_page_cache(struct hugepage *page);
 
 
 void hpa_clear_huge_page(struct hugepage *page, unsigned long address);
+void hpa_zero_huge_page(struct hugepage *page);
+void hpa_clear_huge_pages(struct hugepage **pages, int nr);
+struct dentry;
+struct dentry *hpa_debugfs_root(void);
 
 static inline struct hpa_node *lruvec_node(struct lruvec *lruvec){
     return container_of(lruvec, struct hpa_node, lruvec);	/* container_of is in "include/linux/kernel.h" */
 }
 
-static inline void node_page_state_add(long x, struct hpa_node *node,enum zone_stat_item item)
+void node_page_state_add(long x, struct hpa_node *node,enum zone_stat_item item);
+unsigned long hpa_node_page_state_snapshot(struct hpa_node *node,
+                                           enum zone_stat_item item);
+void hpa_fold_cpu_stats(int cpu);
+int hpa_stat_threshold(struct hpa_node *node);
+
+/* the node total, off by at most stat_threshold per cpu */
+static inline unsigned long hpa_node_page_state(struct hpa_node *node,
+                                                enum zone_stat_item item)
 {
-    atomic_long_add(x, &node->vm_stat[item]);
+    long x = atomic_long_read(&node->vm_stat[item]);
+
+    return x < 0 ? 0 : x;
+}
+
+static inline void count_hpa_events(struct hpa_node *node,
+                                    enum hpa_event_item item, long delta)
+{
+    struct hpa_pcp __percpu *pcp = ACCESS_ONCE(node->pcp);
+
+    /* events before hpa_pcp_init are boot time population, not traffic */
+    if (pcp)
+        this_cpu_add(pcp->events[item], delta);
 }
 
+static inline void count_hpa_event(struct hpa_node *node, enum hpa_event_item item)
+{
+    count_hpa_events(node, item, 1);
+}
+
+unsigned long hpa_node_events(struct hpa_node *node, enum hpa_event_item item);
+
+/* direct reclaim statistics kept by the allocation slow path */
+enum hpa_dr_stat_item {
+    HPA_DR_CALLS,
+    HPA_DR_SUCCESS,
+    HPA_DR_RECLAIMED,
+    HPA_DR_TOTAL_US,
+    HPA_DR_MAX_US,
+    NR_HPA_DR_STAT,
+};
+extern atomic_long_t hpa_dr_stat[NR_HPA_DR_STAT];
+
+/*
+ * log2 latency histograms of the hot paths, per cpu and shown in debugfs
+ * under hpa/. Bucket b counts calls that took [2^(b-1), 2^b) ns, the last
+ * one also everything slower.
+ */
+enum hpa_lat_item {
+    HPA_LAT_ALLOC,          /* hpa_alloc_page_node */
+    HPA_LAT_FREE,           /* __hpa_free_page */
+    HPA_LAT_LOCK_WAIT,      /* __hpa_lock_page */
+    HPA_LAT_UNMAP,          /* hpa_try_to_unmap */
+    HPA_LAT_REFERENCED,     /* hpa_page_referenced */
+    HPA_LAT_CLEAR,          /* hpa_clear_huge_page */
+    NR_HPA_LAT_ITEMS
+};
+#define HPA_LAT_BUCKETS     32
+
+extern bool hpa_lat_enabled;
+
+/* 0 while the histograms are off, which hpa_lat_account then ignores */
+static inline u64 hpa_lat_start(void)
+{
+    return ACCESS_ONCE(hpa_lat_enabled) ? local_clock() : 0;
+}
+
+u64 hpa_lat_account(enum hpa_lat_item item, u64 start);
+
+void hpa_wakeup_kswapd(struct hpa_node *node);
+unsigned long hpa_direct_reclaim(int preferred_nid, nodemask_t *nodemask);
+int hpa_next_best_node(int nid, nodemask_t *nodemask, unsigned long *tried);
+
 void add_hpage_to_lruvec(struct hugepage *hpage,enum lru_list lru);
+void add_hpage_list_to_lruvec(struct list_head *list, int nid, int nr,
+                              enum lru_list lru);
 
 void hp_del_page_from_lru_list(struct hugepage *hpage,
                                 struct lruvec *lruvec, enum lru_list lru);
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# False sharing benchmark for the struct hpa_node and struct hugepage
+# layout: runs debugfs hpa/node_stress on every cpu of the current node
+# under perf c2c and prints the HITM counts. Run it pinned to one node on
+# kernels built with and without the layout change and compare the
+# "Load HITM" lines.
+#
+# usage: hpa_c2c_bench.sh [loops] [node]
+
+LOOPS=${1:-100000}
+NODE=${2:-0}
+DEBUGFS=/sys/kernel/debug/hpa
+OUT=${TMPDIR:-/tmp}/hpa_c2c.$$.data
+
+[ -w $DEBUGFS/node_stress ] || { echo "no $DEBUGFS/node_stress, is debugfs mounted?" >&2; exit 1; }
+
+numactl --cpunodebind=$NODE --membind=$NODE \
+	perf c2c record -a -o $OUT -- sh -c "echo $LOOPS > $DEBUGFS/node_stress" || exit 1
+
+cat $DEBUGFS/node_stress
+perf c2c report -i $OUT --stats 2>/dev/null | grep -E "Load HITM|Load Local HITM|Load Remote HITM|Store Operations"
+perf c2c report -i $OUT --stdio 2>/dev/null | grep -E "hpa_|lruvec" | head -20
+rm -f $OUT
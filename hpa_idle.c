@@ -0,0 +1,159 @@
+/*
+ * Idle hugepage tracking, the HPA counterpart of page_idle
+ *
+ * /sys/kernel/mm/hpa_idle/bitmap holds one bit per hugepage, indexed by
+ * the hugepage number hpa_page_nr(page), in 8 byte words. The numbers run
+ * through the ranges in address order, with no holes between them.
+ * Writing a 1 marks the page idle and clears the young bits of its ptes;
+ * reading returns 1 for pages still idle, that is not accessed through a
+ * mapping since they were marked. Pages that are free, not on an LRU or
+ * locked by someone else read as 0 and are not marked.
+ */
+
+#include <linux/hpa.h>
+#include <linux/hpa_rmap.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/vmalloc.h>
+
+#define HPA_IDLE_BITMAP_CHUNK_SIZE  sizeof(u64)
+#define HPA_IDLE_BITMAP_CHUNK_BITS  (HPA_IDLE_BITMAP_CHUNK_SIZE * BITS_PER_BYTE)
+
+unsigned long *hpa_idle_map;
+unsigned long *hpa_young_map;
+EXPORT_SYMBOL(hpa_idle_map);
+EXPORT_SYMBOL(hpa_young_map);
+
+/* a referenced, locked page on an LRU, or NULL */
+static struct hugepage *hpa_idle_get_page(unsigned long nr)
+{
+    struct hugepage *page = hpa_nr_to_page(nr);
+
+    if (!PageLRU((struct page*)page) ||
+        !get_page_unless_zero((struct page*)page))
+        return NULL;
+    /* raced with the page being freed or isolated */
+    if (unlikely(!PageLRU((struct page*)page)))
+        goto put;
+    if (!hpa_trylock_page(page))
+        goto put;
+    return page;
+put:
+    hpa_put_page(page);
+    return NULL;
+}
+
+static void hpa_idle_put_page(struct hugepage *page)
+{
+    hpa_unlock_page(page);
+    hpa_put_page(page);
+}
+
+static ssize_t hpa_idle_bitmap_read(struct file *file, struct kobject *kobj,
+        struct bin_attribute *attr, char *buf, loff_t pos, size_t count)
+{
+    u64 *out = (u64 *)buf;
+    struct hugepage *page;
+    unsigned long nr, end;
+    int bit;
+
+    if (pos % HPA_IDLE_BITMAP_CHUNK_SIZE || count % HPA_IDLE_BITMAP_CHUNK_SIZE)
+        return -EINVAL;
+
+    nr = pos * BITS_PER_BYTE;
+    if (nr >= hpa_nr_pages)
+        return 0;
+    /* the last word is returned whole, padded with zeroes */
+    end = min_t(unsigned long, nr + count * BITS_PER_BYTE,
+                ALIGN(hpa_nr_pages, HPA_IDLE_BITMAP_CHUNK_BITS));
+
+    for (; nr < end; nr++) {
+        bit = nr % HPA_IDLE_BITMAP_CHUNK_BITS;
+        if (!bit)
+            *out = 0ULL;
+        if (nr < hpa_nr_pages && hpa_page_is_idle(hpa_nr_to_page(nr))) {
+            page = hpa_idle_get_page(nr);
+            if (page) {
+                /* an access since the mark clears idle here */
+                hpa_page_idle_clear_pte_refs(page);
+                if (hpa_page_is_idle(page))
+                    *out |= 1ULL << bit;
+                hpa_idle_put_page(page);
+            }
+        }
+        if (bit == HPA_IDLE_BITMAP_CHUNK_BITS - 1)
+            out++;
+        cond_resched();
+    }
+    return (char *)out - buf;
+}
+
+static ssize_t hpa_idle_bitmap_write(struct file *file, struct kobject *kobj,
+        struct bin_attribute *attr, char *buf, loff_t pos, size_t count)
+{
+    const u64 *in = (u64 *)buf;
+    struct hugepage *page;
+    unsigned long nr, end;
+    int bit;
+
+    if (pos % HPA_IDLE_BITMAP_CHUNK_SIZE || count % HPA_IDLE_BITMAP_CHUNK_SIZE)
+        return -EINVAL;
+
+    nr = pos * BITS_PER_BYTE;
+    if (nr >= hpa_nr_pages)
+        return -ENXIO;
+    end = min_t(unsigned long, nr + count * BITS_PER_BYTE,
+                ALIGN(hpa_nr_pages, HPA_IDLE_BITMAP_CHUNK_BITS));
+
+    for (; nr < end; nr++) {
+        bit = nr % HPA_IDLE_BITMAP_CHUNK_BITS;
+        if (nr < hpa_nr_pages && ((*in >> bit) & 1)) {
+            page = hpa_idle_get_page(nr);
+            if (page) {
+                hpa_page_idle_clear_pte_refs(page);
+                hpa_set_page_idle(page);
+                hpa_idle_put_page(page);
+            }
+        }
+        if (bit == HPA_IDLE_BITMAP_CHUNK_BITS - 1)
+            in++;
+        cond_resched();
+    }
+    return (char *)in - buf;
+}
+
+static struct bin_attribute hpa_idle_bitmap_attr = {
+    .attr   = { .name = "bitmap", .mode = S_IRUSR | S_IWUSR },
+    .read   = hpa_idle_bitmap_read,
+    .write  = hpa_idle_bitmap_write,
+};
+
+static int __init hpa_idle_init(void)
+{
+    size_t size = BITS_TO_LONGS(hpa_nr_pages) * sizeof(long);
+    unsigned long *idle, *young;
+    struct kobject *kobj;
+
+    if (!hpa_nr_pages)
+        return 0;
+
+    idle = vzalloc(size);
+    young = vzalloc(size);
+    if (!idle || !young) {
+        pr_err("hpa: cannot allocate the idle page bitmaps\n");
+        vfree(idle);
+        vfree(young);
+        return -ENOMEM;
+    }
+    hpa_young_map = young;
+    hpa_idle_map = idle;
+
+    kobj = kobject_create_and_add("hpa_idle", mm_kobj);
+    if (!kobj || sysfs_create_bin_file(kobj, &hpa_idle_bitmap_attr)) {
+        pr_err("hpa: cannot create /sys/kernel/mm/hpa_idle/bitmap\n");
+        kobject_put(kobj);
+        return -ENOMEM;
+    }
+    return 0;
+}
+late_initcall(hpa_idle_init);
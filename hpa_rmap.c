@@ -1,5 +1,6 @@
 
 #include <linux/hpa_rmap.h>
+#include "hpa_trace.h"
 
 int hpa_page_mapcount(struct hugepage* page)
 {
@@ -19,27 +20,41 @@ unsigned long hpa_pte_to_pfn(pte_t pte)
 }
 EXPORT_SYMBOL(hpa_pte_to_pfn);
 
+/*
+ * Find the pmd level entry mapping page at address in mm and return it
+ * with mm->page_table_lock held in *ptlp. That is the lock the hugepage
+ * fault path takes; switch to pmd_lockptr only together with it. Unless
+ * sync is set an entry that is not present or maps another page is
+ * skipped without taking the lock.
+ */
 static pte_t *__hpa_page_check_address(struct hugepage *page, struct mm_struct *mm,
                                        unsigned long address, spinlock_t **ptlp, int sync)
 {
     pgd_t *pgd;
     pud_t *pud;
-    pte_t *pte = NULL;
+    pmd_t *pmd;
+    pte_t *pte;
+    pte_t entry;
     spinlock_t *ptl;
 
     pgd = pgd_offset(mm, address);
+    if(!pgd_present(*pgd))
+        return NULL;
+
+    pud = pud_offset(pgd, address);
+    if(!pud_present(*pud))
+        return NULL;
+
+    pmd = pmd_offset(pud, address);
+    pte = (pte_t *) pmd;
 
-    if(pgd_present(*pgd))
+    if(!sync)
     {
-        pud = pud_offset(pgd, address);
-        if(pud_present(*pud))
-        {
-            pte = (pte_t *) pmd_offset(pud, address);
-        }
+        entry = *pte;
+        if(!pte_present(entry) || hpa_page_to_pfn(page) != hpa_pte_to_pfn(entry))
+            return NULL;
     }
 
-    if(!pte) return NULL;
-
     ptl = &mm->page_table_lock;
 
     spin_lock(ptl);
@@ -64,9 +79,71 @@ pte_t *hpa_page_check_address(struct hugepage *page, struct mm_struct *mm,
 }
 EXPORT_SYMBOL(hpa_page_check_address);
 
+static void hpa_flush_tlb_local(void *info)
+{
+    local_flush_tlb();
+}
+
+/*
+ * Send the flush for every pte cleared into batch: one IPI round to the
+ * cpus that had any of the mms loaded, then the mmu notifiers of each mm
+ * over the range that was unmapped from it.
+ */
+void hpa_try_to_unmap_flush(struct hpa_tlb_batch *batch)
+{
+    int i;
+
+    if (!batch->nr_mm)
+        return;
+
+    on_each_cpu_mask(&batch->cpumask, hpa_flush_tlb_local, NULL, true);
+    for (i = 0; i < batch->nr_mm; i++) {
+        mmu_notifier_invalidate_range_start(batch->mm[i].mm,
+                batch->mm[i].start, batch->mm[i].end);
+        mmu_notifier_invalidate_range_end(batch->mm[i].mm,
+                batch->mm[i].start, batch->mm[i].end);
+        mmdrop(batch->mm[i].mm);
+    }
+    batch->nr_mm = 0;
+    cpumask_clear(&batch->cpumask);
+}
+EXPORT_SYMBOL(hpa_try_to_unmap_flush);
+
+/*
+ * Note a pte of mm at address cleared without a flush. Returns false when
+ * the batch has no room for another mm, the caller then flushes the pte
+ * itself. Called under the pte lock.
+ */
+static bool hpa_tlb_batch_add(struct hpa_tlb_batch *batch,
+                              struct mm_struct *mm, unsigned long address)
+{
+    int i;
+
+    for (i = 0; i < batch->nr_mm; i++)
+        if (batch->mm[i].mm == mm)
+            break;
+    if (i == batch->nr_mm) {
+        if (i == HPA_TLB_BATCH_MM)
+            return false;
+        atomic_inc(&mm->mm_count);
+        batch->mm[i].mm = mm;
+        batch->mm[i].start = address;
+        batch->mm[i].end = address + HUGEPAGE_SIZE;
+        batch->nr_mm++;
+    } else {
+        batch->mm[i].start = min(batch->mm[i].start, address);
+        batch->mm[i].end = max(batch->mm[i].end, address + HUGEPAGE_SIZE);
+    }
+    /* any cpu that loads mm from now on cannot see the cleared pte */
+    cpumask_or(&batch->cpumask, &batch->cpumask, mm_cpumask(mm));
+    return true;
+}
+
 static int hpa_try_to_unmap_one(struct hugepage* page, struct vm_area_struct *vma,
-                                unsigned long address, enum ttu_flags flags)
+                                unsigned long address, enum ttu_flags flags,
+                                struct hpa_tlb_batch *batch)
 {
+    bool deferred = false;
     struct mm_struct *mm = vma->vm_mm;
     pte_t *pte;
     pte_t pteval;
@@ -110,7 +187,13 @@ static int hpa_try_to_unmap_one(struct hugepage* page, struct vm_area_struct *vm
      flush_cache_page(vma, address, hpa_page_to_pfn(page));
 
     //获取pte中的内容，并对pte清空
-     pteval = ptep_clear_flush(vma, address, pte);
+     if (batch) {
+         pteval = ptep_get_and_clear(mm, address, pte);
+         deferred = hpa_tlb_batch_add(batch, mm, address);
+         if (!deferred)
+             flush_tlb_page(vma, address);
+     } else
+         pteval = ptep_clear_flush(vma, address, pte);
 
     //如果pte标记了此页为脏页，则设置page的PG_dirty标志位
      if(pte_dirty(pteval))
@@ -129,7 +212,7 @@ static int hpa_try_to_unmap_one(struct hugepage* page, struct vm_area_struct *vm
 
 out_unmap:
      pte_unmap_unlock(pte, ptl);
-     if(ret != SWAP_FAIL)
+     if(ret != SWAP_FAIL && !deferred)
         mmu_notifier_invalidate_page(mm, address);
 out:
     return ret;
@@ -165,7 +248,8 @@ unsigned long hpa_vma_address(struct hugepage* page, struct vm_area_struct *vma)
 }
 EXPORT_SYMBOL(hpa_vma_address);
 
-static int hpa_try_to_unmap_file(struct hugepage* page, enum ttu_flags flags)
+static int hpa_try_to_unmap_file(struct hugepage* page, enum ttu_flags flags,
+                                 struct hpa_tlb_batch *batch)
 {
     struct address_space *mapping = hpa_page_mapping(page);
     pgoff_t  pgoff = page->index;
@@ -185,7 +269,7 @@ static int hpa_try_to_unmap_file(struct hugepage* page, enum ttu_flags flags)
 
         cond_resched();
 
-        ret = hpa_try_to_unmap_one(page, vma, address, flags);
+        ret = hpa_try_to_unmap_one(page, vma, address, flags, batch);
 
         if(ret != SWAP_AGAIN || hpa_page_mapcount_is_zero(page))
             goto done;
@@ -199,19 +283,61 @@ done:
     return ret;
 }
 
-int hpa_try_to_unmap(struct hugepage* page, enum ttu_flags flags){
-
+static int __hpa_try_to_unmap(struct hugepage* page, enum ttu_flags flags,
+                              struct hpa_tlb_batch *batch)
+{
      int ret;
+     u64 start = hpa_lat_start();
 
-     ret = hpa_try_to_unmap_file(page, flags);
+     ret = hpa_try_to_unmap_file(page, flags, batch);
 
      if(ret != SWAP_MLOCK && !hpa_page_mapcount(page))
             ret = SWAP_SUCCESS;
 
+     trace_hpa_try_to_unmap(page, ret, hpa_lat_account(HPA_LAT_UNMAP, start));
      return ret;
 }
+
+int hpa_try_to_unmap(struct hugepage* page, enum ttu_flags flags){
+
+     return __hpa_try_to_unmap(page, flags, NULL);
+}
 EXPORT_SYMBOL(hpa_try_to_unmap);
 
+/*
+ * As hpa_try_to_unmap, but the TLB flush of the cleared ptes is left to
+ * hpa_try_to_unmap_flush(batch). Until then other cpus may still reach
+ * the page through stale TLB entries, so it must not be freed or have its
+ * dirty state trusted before the flush.
+ */
+int hpa_try_to_unmap_batch(struct hugepage* page, enum ttu_flags flags,
+                           struct hpa_tlb_batch *batch)
+{
+     return __hpa_try_to_unmap(page, flags, batch);
+}
+EXPORT_SYMBOL(hpa_try_to_unmap_batch);
+
+/*
+ * Unmap nr locked pages with a single TLB flush at the end, storing the
+ * SWAP_* result of each in ret[]. Falls back to flushing per pte if the
+ * batch cannot be allocated.
+ */
+void hpa_try_to_unmap_pages(struct hugepage **pages, int nr,
+                            enum ttu_flags flags, int *ret)
+{
+     struct hpa_tlb_batch *batch;
+     int i;
+
+     batch = hpa_tlb_batch_alloc();
+     for (i = 0; i < nr; i++)
+         ret[i] = __hpa_try_to_unmap(pages[i], flags, batch);
+     if (batch) {
+         hpa_try_to_unmap_flush(batch);
+         kfree(batch);
+     }
+}
+EXPORT_SYMBOL(hpa_try_to_unmap_pages);
+
 
 static inline int hpa_page_mapped(struct hugepage *page)
 {
@@ -249,6 +375,7 @@ static int hpa_page_referenced_one(struct hugepage *page, struct vm_area_struct
         if (ptep_clear_flush_young_notify(vma, address, pte)) {
             if (likely(!VM_SequentialReadHint(vma)))
                 referenced++;
+            hpa_clear_page_idle(page);
         }
 
         pte_unmap_unlock(pte, ptl);
@@ -301,6 +428,7 @@ int hpa_page_referenced(struct hugepage *page,
 {
         int referenced = 0;
         int we_locked = 0;
+        u64 start = hpa_lat_start();
 
         *vm_flags = 0;
         if (hpa_page_mapped(page) && hpa_page_rmapping(page)) {
@@ -320,12 +448,56 @@ int hpa_page_referenced(struct hugepage *page,
             if (page_test_and_clear_young(hpa_page_to_pfn(page)))
                 referenced++;
         }
+        /* young ptes the idle scan cleared since the last look */
+        if (hpa_test_and_clear_page_young(page))
+            referenced++;
 out:
+        trace_hpa_page_referenced(page, referenced,
+                                  hpa_lat_account(HPA_LAT_REFERENCED, start));
         return referenced;
 }
 EXPORT_SYMBOL(hpa_page_referenced);
 
 
+/*
+ * Clear the young bit of every pte mapping page without a TLB flush, as
+ * page_idle does: a missed access only makes the page look idle a little
+ * longer. A young pte clears idle and sets young for reclaim to find.
+ * page must be locked.
+ */
+void hpa_page_idle_clear_pte_refs(struct hugepage *page)
+{
+        struct address_space *mapping = page->mapping;
+        pgoff_t pgoff = page->index;
+        struct vm_area_struct *vma;
+        spinlock_t *ptl;
+        pte_t *pte;
+        unsigned long address;
+        int young;
+
+        if (!hpa_page_mapped(page) || !mapping)
+            return;
+
+        mutex_lock(&mapping->i_mmap_mutex);
+        vma_interval_tree_foreach(vma, &mapping->i_mmap, pgoff, pgoff) {
+            address = hpa_vma_address(page, vma);
+            pte = hpa_page_check_address(page, vma->vm_mm, address, &ptl, 0);
+            if (!pte)
+                continue;
+            /* no flush for the cpu ptes, secondary mmus have no other way */
+            young = ptep_test_and_clear_young(vma, address, pte);
+            young |= mmu_notifier_clear_flush_young(vma->vm_mm, address);
+            if (young) {
+                hpa_clear_page_idle(page);
+                hpa_set_page_young(page);
+            }
+            pte_unmap_unlock(pte, ptl);
+        }
+        mutex_unlock(&mapping->i_mmap_mutex);
+}
+EXPORT_SYMBOL(hpa_page_idle_clear_pte_refs);
+
+
 void hpa_page_remove_rmap(struct hugepage *page)
 {
         //bool locked;
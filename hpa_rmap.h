@@ -33,10 +33,41 @@ unsigned long hpa_vma_address(struct hugepage* page, struct vm_area_struct *vma)
 
 int hpa_try_to_unmap(struct hugepage* page, enum ttu_flags flags);
 
+/*
+ * ptes cleared by hpa_try_to_unmap_batch and not yet flushed: the mms they
+ * belonged to, pinned, with the range unmapped from each, and every cpu
+ * that may hold a TLB entry for them. Large with many cpus, so allocated
+ * rather than put on the reclaim stack.
+ */
+#define HPA_TLB_BATCH_MM    16
+
+struct hpa_tlb_batch {
+    struct cpumask cpumask;
+    int nr_mm;
+    struct {
+        struct mm_struct *mm;
+        unsigned long start, end;
+    } mm[HPA_TLB_BATCH_MM];
+};
+
+/* reclaim must not sleep on this allocation, NULL means unbatched */
+static inline struct hpa_tlb_batch *hpa_tlb_batch_alloc(void)
+{
+    return kzalloc(sizeof(struct hpa_tlb_batch), GFP_NOWAIT | __GFP_NOWARN);
+}
+
+int hpa_try_to_unmap_batch(struct hugepage* page, enum ttu_flags flags,
+                           struct hpa_tlb_batch *batch);
+void hpa_try_to_unmap_flush(struct hpa_tlb_batch *batch);
+void hpa_try_to_unmap_pages(struct hugepage **pages, int nr,
+                            enum ttu_flags flags, int *ret);
+
 int hpa_page_referenced(struct hugepage *page, int is_locked, struct mem_cgroup *memcg, unsigned long *vm_flags);
 
 void hpa_page_remove_rmap(struct hugepage* page);
 
+void hpa_page_idle_clear_pte_refs(struct hugepage *page);
+
 
 #endif
 
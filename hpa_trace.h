@@ -0,0 +1,159 @@
+/*
+ * Tracepoints of the hugepage allocator hot paths. The latency_ns fields
+ * come from the latency histograms and read 0 while hpa.latency_hist is
+ * off.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hpa
+
+#if !defined(_TRACE_HPA_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_HPA_H
+
+#include <linux/tracepoint.h>
+#include <linux/hpa.h>
+
+#define hpa_trace_pfn(page)     ((page) ? hpa_page_to_pfn(page) : 0UL)
+
+TRACE_EVENT(hpa_alloc_page_node,
+
+    TP_PROTO(int nid, struct hugepage *page, int scanned, u64 latency_ns),
+
+    TP_ARGS(nid, page, scanned, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(int,            nid)
+        __field(unsigned long,  pfn)
+        __field(int,            scanned)
+        __field(u64,            latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->nid        = nid;
+        __entry->pfn        = hpa_trace_pfn(page);
+        __entry->scanned    = scanned;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("nid=%d pfn=0x%lx sections_scanned=%d latency_ns=%llu",
+        __entry->nid, __entry->pfn, __entry->scanned,
+        (unsigned long long)__entry->latency_ns)
+);
+
+TRACE_EVENT(hpa_free_page,
+
+    TP_PROTO(struct hugepage *page, u64 latency_ns),
+
+    TP_ARGS(page, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(int,            nid)
+        __field(unsigned long,  pfn)
+        __field(u64,            latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->nid        = hpa_page_to_nid(page);
+        __entry->pfn        = hpa_trace_pfn(page);
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("nid=%d pfn=0x%lx latency_ns=%llu",
+        __entry->nid, __entry->pfn, (unsigned long long)__entry->latency_ns)
+);
+
+TRACE_EVENT(hpa_lock_page_wait,
+
+    TP_PROTO(struct hugepage *page, u64 latency_ns),
+
+    TP_ARGS(page, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned long,  pfn)
+        __field(u64,            latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->pfn        = hpa_trace_pfn(page);
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("pfn=0x%lx latency_ns=%llu",
+        __entry->pfn, (unsigned long long)__entry->latency_ns)
+);
+
+TRACE_EVENT(hpa_try_to_unmap,
+
+    TP_PROTO(struct hugepage *page, int ret, u64 latency_ns),
+
+    TP_ARGS(page, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned long,  pfn)
+        __field(int,            ret)
+        __field(u64,            latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->pfn        = hpa_trace_pfn(page);
+        __entry->ret        = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("pfn=0x%lx ret=%d latency_ns=%llu",
+        __entry->pfn, __entry->ret, (unsigned long long)__entry->latency_ns)
+);
+
+TRACE_EVENT(hpa_page_referenced,
+
+    TP_PROTO(struct hugepage *page, int referenced, u64 latency_ns),
+
+    TP_ARGS(page, referenced, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned long,  pfn)
+        __field(int,            referenced)
+        __field(u64,            latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->pfn        = hpa_trace_pfn(page);
+        __entry->referenced = referenced;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("pfn=0x%lx referenced=%d latency_ns=%llu",
+        __entry->pfn, __entry->referenced,
+        (unsigned long long)__entry->latency_ns)
+);
+
+TRACE_EVENT(hpa_clear_huge_page,
+
+    TP_PROTO(struct hugepage *page, bool zeroed, u64 latency_ns),
+
+    TP_ARGS(page, zeroed, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned long,  pfn)
+        __field(bool,           zeroed)
+        __field(u64,            latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->pfn        = hpa_trace_pfn(page);
+        __entry->zeroed     = zeroed;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("pfn=0x%lx zeroed=%d latency_ns=%llu",
+        __entry->pfn, __entry->zeroed, (unsigned long long)__entry->latency_ns)
+);
+
+#endif /* _TRACE_HPA_H */
+
+/* lives next to the sources rather than in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hpa_trace
+#include <trace/define_trace.h>
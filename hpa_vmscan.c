@@ -0,0 +1,454 @@
+/*
+ * Reclaim of page cache hugepages from the hpa_node LRUs
+ */
+
+#include <linux/hpa.h>
+#include <linux/hpa_rmap.h>
+#include <linux/hugetlb.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/swap.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+
+#ifdef MODULE_PARAM_PREFIX
+#undef MODULE_PARAM_PREFIX
+#endif
+#define MODULE_PARAM_PREFIX "hpa."
+
+/* hugepages isolated from an LRU at a time */
+#define HPA_SCAN_BATCH      8UL
+
+/*
+ * Budget of one direct reclaim call: stop after direct_reclaim_batch pages
+ * are freed, direct_reclaim_scan pages are scanned or direct_reclaim_us
+ * have passed, whichever comes first.
+ */
+static unsigned long hpa_direct_reclaim_batch = 4;
+static unsigned long hpa_direct_reclaim_scan = 64;
+static unsigned int hpa_direct_reclaim_us = 2000;
+module_param_named(direct_reclaim_batch, hpa_direct_reclaim_batch, ulong, 0644);
+module_param_named(direct_reclaim_scan, hpa_direct_reclaim_scan, ulong, 0644);
+module_param_named(direct_reclaim_us, hpa_direct_reclaim_us, uint, 0644);
+
+#define hpa_lru_to_page(_head) (list_entry((_head)->prev, struct hugepage, lru))
+
+static inline unsigned long hpa_node_free_pages(struct hpa_node *node)
+{
+    return hpa_node_page_state(node, NR_FREE_PAGES);
+}
+
+static inline unsigned long hpa_node_lru_pages(struct hpa_node *node, enum lru_list lru)
+{
+    return hpa_node_page_state(node, NR_LRU_BASE + lru);
+}
+
+/*
+ * Take up to nr_to_scan pages off the tail of the lru list onto dst, with a
+ * reference held on each. Pages already on their way to the free lists are
+ * skipped.
+ */
+static unsigned long hpa_isolate_lru_pages(unsigned long nr_to_scan,
+                                           struct hpa_node *node, struct list_head *dst,
+                                           unsigned long *nr_scanned, enum lru_list lru)
+{
+    struct list_head *src = &node->lruvec.lists[lru];
+    struct hugepage *page;
+    unsigned long scan, nr_taken = 0;
+
+    spin_lock_irq(&node->lru_lock);
+    for (scan = 0; scan < nr_to_scan && !list_empty(src); scan++) {
+        page = hpa_lru_to_page(src);
+
+        if (!get_page_unless_zero((struct page*)page)) {
+            list_move(&page->lru, src);
+            continue;
+        }
+        ClearPageLRU((struct page*)page);
+        list_move(&page->lru, dst);
+        nr_taken++;
+    }
+    node_page_state_add(-nr_taken, node, NR_LRU_BASE + lru);
+    node->pages_scanned += scan;
+    spin_unlock_irq(&node->lru_lock);
+
+    *nr_scanned = scan;
+    return nr_taken;
+}
+
+/*
+ * Put isolated pages back on the LRU their PageActive says, dropping the
+ * isolation reference. Pages whose last reference that was are freed.
+ */
+static void hpa_putback_lru_pages(struct hpa_node *node, struct list_head *list)
+{
+    struct hugepage *page, *next;
+    enum lru_list lru;
+    LIST_HEAD(free);
+
+    spin_lock_irq(&node->lru_lock);
+    list_for_each_entry_safe(page, next, list, lru) {
+        list_del(&page->lru);
+        if (put_page_testzero((struct page*)page)) {
+            ClearPageActive((struct page*)page);
+            list_add(&page->lru, &free);
+            continue;
+        }
+        lru = PageActive((struct page*)page) ? LRU_ACTIVE_FILE : LRU_INACTIVE_FILE;
+        hp_add_page_to_lru_list(page, &node->lruvec, lru);
+    }
+    spin_unlock_irq(&node->lru_lock);
+
+    hpa_free_page_list(&free);
+}
+
+static enum page_references hpa_page_check_references(struct hugepage *page,
+                                                      struct scan_control *sc)
+{
+    int referenced_ptes, referenced_page;
+    unsigned long vm_flags;
+
+    referenced_ptes = hpa_page_referenced(page, 1, sc->target_mem_cgroup, &vm_flags);
+    referenced_page = TestClearPageReferenced((struct page*)page);
+
+    if (vm_flags & VM_LOCKED)
+        return PAGEREF_ACTIVATE;
+
+    if (referenced_ptes) {
+        SetPageReferenced((struct page*)page);
+        if (referenced_page || referenced_ptes > 1)
+            return PAGEREF_ACTIVATE;
+        return PAGEREF_KEEP;
+    }
+
+    if (referenced_page)
+        return PAGEREF_RECLAIM_CLEAN;
+
+    return PAGEREF_RECLAIM;
+}
+
+/*
+ * Drop a locked, clean, unmapped page from its mapping. Only the page
+ * cache and the isolation references may be left on it.
+ */
+static int hpa_remove_mapping(struct address_space *mapping, struct hugepage *page)
+{
+    struct inode *inode = mapping->host;
+    void (*freepage)(struct page *) = mapping->a_ops->freepage;
+
+    spin_lock_irq(&mapping->tree_lock);
+    if (!page_freeze_refs((struct page*)page, 2)) {
+        spin_unlock_irq(&mapping->tree_lock);
+        return 0;
+    }
+    if (unlikely(PageDirty((struct page*)page))) {
+        page_unfreeze_refs((struct page*)page, 2);
+        spin_unlock_irq(&mapping->tree_lock);
+        return 0;
+    }
+    __hpa_delete_from_page_cache(page);
+    spin_unlock_irq(&mapping->tree_lock);
+
+    spin_lock(&inode->i_lock);
+    inode->i_blocks -= blocks_per_huge_page(hstate_inode(inode));
+    spin_unlock(&inode->i_lock);
+
+    if (freepage)
+        freepage((struct page*)page);
+    return 1;
+}
+
+/*
+ * Try to free the isolated pages on page_list. Hugepages have no backing
+ * store to write to, so only clean pages are evicted; dirty ones stay.
+ * Freed pages are taken off page_list, the rest are left for putback.
+ *
+ * Mapped pages are unmapped in a first pass with their TLB flushes
+ * deferred, so the whole list costs one flush, and only checked and
+ * dropped from their mapping in a second pass after that flush.
+ */
+static unsigned long hpa_shrink_page_list(struct list_head *page_list,
+                                          struct hpa_node *node,
+                                          struct scan_control *sc)
+{
+    struct hugepage *page, *next;
+    struct address_space *mapping;
+    struct hpa_tlb_batch *batch;
+    unsigned long nr_reclaimed = 0;
+    LIST_HEAD(unmapped);
+    LIST_HEAD(free);
+
+    batch = sc->may_unmap ? hpa_tlb_batch_alloc() : NULL;
+
+    list_for_each_entry_safe(page, next, page_list, lru) {
+        cond_resched();
+
+        if (!hpa_trylock_page(page))
+            continue;
+
+        switch (hpa_page_check_references(page, sc)) {
+        case PAGEREF_ACTIVATE:
+            goto activate_locked;
+        case PAGEREF_KEEP:
+            goto keep_locked;
+        case PAGEREF_RECLAIM:
+        case PAGEREF_RECLAIM_CLEAN:
+            ; /* try to reclaim the page below */
+        }
+
+        mapping = hpa_page_mapping(page);
+        if (!mapping || PageDirty((struct page*)page) ||
+            PageWriteback((struct page*)page))
+            goto keep_locked;
+
+        if (hpa_page_mapcount(page) && sc->may_unmap) {
+            switch (hpa_try_to_unmap_batch(page, TTU_UNMAP, batch)) {
+            case SWAP_FAIL:
+                goto activate_locked;
+            case SWAP_AGAIN:
+            case SWAP_MLOCK:
+                goto keep_locked;
+            case SWAP_SUCCESS:
+                ; /* try to free the page after the flush */
+            }
+        }
+        list_move_tail(&page->lru, &unmapped);
+        continue;
+
+activate_locked:
+        SetPageActive((struct page*)page);
+keep_locked:
+        hpa_unlock_page(page);
+    }
+
+    if (batch) {
+        hpa_try_to_unmap_flush(batch);
+        kfree(batch);
+    }
+
+    list_for_each_entry_safe(page, next, &unmapped, lru) {
+        mapping = hpa_page_mapping(page);
+
+        /* unmapping may have moved a dirty pte bit onto the page */
+        if (hpa_page_mapcount(page) || PageDirty((struct page*)page) ||
+            !hpa_remove_mapping(mapping, page)) {
+            hpa_unlock_page(page);
+            list_move(&page->lru, page_list);
+            continue;
+        }
+
+        __clear_page_locked((struct page*)page);
+        ClearPageActive((struct page*)page);
+        list_move(&page->lru, &free);
+        nr_reclaimed++;
+    }
+
+    hpa_free_page_list(&free);
+    return nr_reclaimed;
+}
+
+static unsigned long hpa_shrink_inactive_list(unsigned long nr_to_scan,
+                                              struct hpa_node *node,
+                                              struct scan_control *sc)
+{
+    unsigned long nr_scanned, nr_taken, nr_reclaimed;
+    LIST_HEAD(page_list);
+
+    nr_taken = hpa_isolate_lru_pages(nr_to_scan, node, &page_list,
+                                     &nr_scanned, LRU_INACTIVE_FILE);
+    sc->nr_scanned += nr_scanned;
+    if (!nr_taken)
+        return 0;
+
+    nr_reclaimed = hpa_shrink_page_list(&page_list, node, sc);
+    hpa_putback_lru_pages(node, &page_list);
+    return nr_reclaimed;
+}
+
+/*
+ * Age the active list: pages referenced since the last pass stay active,
+ * the others move to the inactive list to be considered for eviction.
+ */
+static void hpa_shrink_active_list(unsigned long nr_to_scan,
+                                   struct hpa_node *node,
+                                   struct scan_control *sc)
+{
+    struct hugepage *page, *next;
+    unsigned long nr_scanned, vm_flags;
+    LIST_HEAD(page_list);
+
+    hpa_isolate_lru_pages(nr_to_scan, node, &page_list, &nr_scanned,
+                          LRU_ACTIVE_FILE);
+    sc->nr_scanned += nr_scanned;
+
+    list_for_each_entry_safe(page, next, &page_list, lru) {
+        cond_resched();
+        if (hpa_page_referenced(page, 0, sc->target_mem_cgroup, &vm_flags))
+            continue;
+        ClearPageActive((struct page*)page);
+    }
+    hpa_putback_lru_pages(node, &page_list);
+}
+
+static inline int hpa_inactive_is_low(struct hpa_node *node)
+{
+    return hpa_node_lru_pages(node, LRU_INACTIVE_FILE) <
+           hpa_node_lru_pages(node, LRU_ACTIVE_FILE);
+}
+
+/*
+ * One pass over the node LRUs at sc->priority, scanning 1/2^priority of
+ * them in batches until sc->nr_to_reclaim pages have been freed. A non-zero
+ * deadline (local_clock) or a max_scan below the pass size bound the pass.
+ */
+static void hpa_shrink_node(struct hpa_node *node, struct scan_control *sc,
+                            unsigned long max_scan, u64 deadline)
+{
+    unsigned long nr_to_scan;
+
+    nr_to_scan = (hpa_node_lru_pages(node, LRU_INACTIVE_FILE) +
+                  hpa_node_lru_pages(node, LRU_ACTIVE_FILE)) >> sc->priority;
+    nr_to_scan = min(max(nr_to_scan, HPA_SCAN_BATCH), max_scan);
+
+    while (nr_to_scan && sc->nr_reclaimed < sc->nr_to_reclaim) {
+        unsigned long batch = min(nr_to_scan, HPA_SCAN_BATCH);
+
+        if (deadline && local_clock() >= deadline)
+            break;
+
+        if (hpa_inactive_is_low(node))
+            hpa_shrink_active_list(batch, node, sc);
+        sc->nr_reclaimed += hpa_shrink_inactive_list(batch, node, sc);
+        nr_to_scan -= batch;
+    }
+}
+
+static inline bool hpa_node_below_low(struct hpa_node *node)
+{
+    return hpa_node_free_pages(node) < node->watermark;
+}
+
+static inline bool hpa_node_balanced(struct hpa_node *node)
+{
+    return hpa_node_free_pages(node) >= node->watermark_high;
+}
+
+/* reclaim until the node is back above its high watermark */
+static void hpa_balance_node(struct hpa_node *node)
+{
+    struct scan_control sc = {
+        .gfp_mask = GFP_KERNEL,
+        .may_writepage = 0,
+        .may_unmap = 1,
+        .may_swap = 0,
+        .order = 0,
+    };
+
+    for (sc.priority = DEF_PRIORITY; sc.priority >= 0; sc.priority--) {
+        if (hpa_node_balanced(node))
+            return;
+        sc.nr_scanned = 0;
+        sc.nr_reclaimed = 0;
+        sc.nr_to_reclaim = node->watermark_high - hpa_node_free_pages(node);
+        hpa_shrink_node(node, &sc, ULONG_MAX, 0);
+        if (try_to_freeze() || kthread_should_stop())
+            return;
+    }
+    /* a full priority sweep could not get there, stop until pages are freed */
+    if (!hpa_node_balanced(node))
+        node->all_unreclaimable = 1;
+}
+
+static int hpa_kswapd(void *p)
+{
+    struct hpa_node *node = p;
+
+    current->flags |= PF_MEMALLOC;
+    set_freezable();
+
+    while (!kthread_should_stop()) {
+        wait_event_freezable(node->kswapd_wait,
+                             (hpa_node_below_low(node) && !node->all_unreclaimable) ||
+                             kthread_should_stop());
+        if (kthread_should_stop())
+            break;
+        hpa_balance_node(node);
+    }
+    return 0;
+}
+
+void hpa_wakeup_kswapd(struct hpa_node *node)
+{
+    if (!hpa_node_below_low(node) || node->all_unreclaimable)
+        return;
+    if (!waitqueue_active(&node->kswapd_wait))
+        return;
+    wake_up_interruptible(&node->kswapd_wait);
+}
+EXPORT_SYMBOL(hpa_wakeup_kswapd);
+
+/*
+ * Synchronous reclaim for an allocation that found every allowed node
+ * empty: frees a small batch from the nodes in nodemask, nearest to
+ * preferred_nid first, within the direct_reclaim_* budget. Returns the
+ * number of pages freed.
+ */
+unsigned long hpa_direct_reclaim(int preferred_nid, nodemask_t *nodemask)
+{
+    struct scan_control sc = {
+        .gfp_mask = GFP_KERNEL,
+        .may_writepage = 0,
+        .may_unmap = 1,
+        .may_swap = 0,
+        .order = 0,
+        .nr_to_reclaim = ACCESS_ONCE(hpa_direct_reclaim_batch),
+    };
+    unsigned long max_scan = ACCESS_ONCE(hpa_direct_reclaim_scan);
+    u64 deadline = local_clock() + (u64)ACCESS_ONCE(hpa_direct_reclaim_us) * NSEC_PER_USEC;
+    unsigned long tried = 0;
+    int nid;
+
+    might_sleep();
+    /* reclaim itself must not recurse into reclaim */
+    if (current->flags & PF_MEMALLOC)
+        return 0;
+    current->flags |= PF_MEMALLOC;
+
+    while ((nid = hpa_next_best_node(preferred_nid, nodemask, &tried)) != NUMA_NO_NODE) {
+        struct hpa_node *node = HPA_NODE_DATA(nid);
+
+        for (sc.priority = DEF_PRIORITY; sc.priority >= 0; sc.priority--) {
+            if (sc.nr_reclaimed >= sc.nr_to_reclaim || sc.nr_scanned >= max_scan ||
+                local_clock() >= deadline)
+                goto out;
+            hpa_shrink_node(node, &sc, max_scan - sc.nr_scanned, deadline);
+        }
+    }
+out:
+    current->flags &= ~PF_MEMALLOC;
+    return sc.nr_reclaimed;
+}
+EXPORT_SYMBOL(hpa_direct_reclaim);
+
+static int __init hpa_kswapd_init(void)
+{
+    struct task_struct *tsk;
+    const struct cpumask *cpumask;
+    int nid;
+
+    for_each_huge_node(nid, HPNODE_MASK) {
+        tsk = kthread_create_on_node(hpa_kswapd, HPA_NODE_DATA(nid), nid,
+                                     "hp_kswapd%d", nid);
+        if (IS_ERR(tsk)) {
+            pr_err("hpa: failed to start hp_kswapd for node %d\n", nid);
+            continue;
+        }
+        cpumask = cpumask_of_node(nid);
+        if (!cpumask_empty(cpumask))
+            set_cpus_allowed_ptr(tsk, cpumask);
+        HPA_NODE_DATA(nid)->hp_kswapd = tsk;
+        wake_up_process(tsk);
+    }
+    return 0;
+}
+module_init(hpa_kswapd_init);
@@ -0,0 +1,470 @@
+/*
+ * HPA statistics: per-cpu node counters and events, reported through
+ * /proc/hpainfo and /sys/devices/system/node/nodeN/hpainfo, and the hot
+ * path latency histograms and the node stress trigger in debugfs. All
+ * counts are in hugepages.
+ */
+
+#include <linux/hpa.h>
+#include <linux/cpu.h>
+#include <linux/node.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+
+#define CREATE_TRACE_POINTS
+#include "hpa_trace.h"
+
+#ifdef MODULE_PARAM_PREFIX
+#undef MODULE_PARAM_PREFIX
+#endif
+#define MODULE_PARAM_PREFIX "hpa."
+
+/*
+ * The old free_page global, refreshed whenever an NR_FREE_PAGES atomic
+ * changes, so it is as exact as hpa_nr_free_pages().
+ */
+static inline void hpa_sync_free_page(enum zone_stat_item item)
+{
+    if (item == NR_FREE_PAGES)
+        ACCESS_ONCE(free_page) = hpa_nr_free_pages();
+}
+
+/*
+ * Like the zone vm_stat_diff: each cpu keeps its changes to a node counter
+ * to itself until they pass stat_threshold either way and only then
+ * touches the shared atomic. Until hpa_pcp_init there is nowhere to keep
+ * them and the atomic is updated directly.
+ */
+void node_page_state_add(long x, struct hpa_node *node, enum zone_stat_item item)
+{
+    struct hpa_pcp __percpu *pcp = ACCESS_ONCE(node->pcp);
+    unsigned long flags;
+    s8 *p;
+    long t;
+
+    if (!x)
+        return;
+    if (!pcp) {
+        atomic_long_add(x, &node->vm_stat[item]);
+        hpa_sync_free_page(item);
+        return;
+    }
+
+    local_irq_save(flags);
+    p = __this_cpu_ptr(pcp)->vm_stat_diff + item;
+    t = *p + x;
+    if (unlikely(t > node->stat_threshold || t < -node->stat_threshold)) {
+        atomic_long_add(t, &node->vm_stat[item]);
+        hpa_sync_free_page(item);
+        t = 0;
+    }
+    *p = t;
+    local_irq_restore(flags);
+}
+EXPORT_SYMBOL(node_page_state_add);
+
+/* the exact node total, for reporting rather than for hot paths */
+unsigned long hpa_node_page_state_snapshot(struct hpa_node *node,
+                                           enum zone_stat_item item)
+{
+    long x = atomic_long_read(&node->vm_stat[item]);
+    int cpu;
+
+    if (node->pcp)
+        for_each_online_cpu(cpu)
+            x += per_cpu_ptr(node->pcp, cpu)->vm_stat_diff[item];
+    return x < 0 ? 0 : x;
+}
+EXPORT_SYMBOL(hpa_node_page_state_snapshot);
+
+/* move the deltas of a dead cpu into the node totals */
+void hpa_fold_cpu_stats(int cpu)
+{
+    struct hpa_node *node;
+    struct hpa_pcp *pcp;
+    int nid, i;
+
+    for_each_huge_node(nid, HPNODE_MASK) {
+        node = HPA_NODE_DATA(nid);
+        if (!node->pcp)
+            continue;
+        pcp = per_cpu_ptr(node->pcp, cpu);
+        for (i = 0; i < NR_VM_ZONE_STAT_ITEMS; i++) {
+            if (pcp->vm_stat_diff[i]) {
+                atomic_long_add(pcp->vm_stat_diff[i], &node->vm_stat[i]);
+                pcp->vm_stat_diff[i] = 0;
+            }
+        }
+    }
+}
+
+/* keeps the drift of a node counter over all cpus within 1/64 of the node */
+int hpa_stat_threshold(struct hpa_node *node)
+{
+    unsigned long t = node->node_present_pages / (64 * num_possible_cpus());
+
+    return clamp(t, 1UL, 32UL);
+}
+
+/* events of offlined cpus are kept, so sum over every possible cpu */
+unsigned long hpa_node_events(struct hpa_node *node, enum hpa_event_item item)
+{
+    unsigned long sum = 0;
+    int cpu;
+
+    if (node->pcp)
+        for_each_possible_cpu(cpu)
+            sum += per_cpu_ptr(node->pcp, cpu)->events[item];
+    return sum;
+}
+EXPORT_SYMBOL(hpa_node_events);
+
+static const char * const hpa_event_text[NR_HPA_EVENT_ITEMS] = {
+    [HPA_ALLOC]         = "Alloc",
+    [HPA_ALLOC_EMPTY]   = "AllocEmpty",
+    [HPA_ALLOC_FAIL]    = "AllocFail",
+    [HPA_FREE]          = "Free",
+    [HPA_ZEROED_HIT]    = "ZeroedHit",
+    [HPA_ZEROED_MISS]   = "ZeroedMiss",
+};
+
+static const char * const hpa_dr_stat_text[NR_HPA_DR_STAT] = {
+    [HPA_DR_CALLS]      = "DirectReclaimCalls",
+    [HPA_DR_SUCCESS]    = "DirectReclaimSuccess",
+    [HPA_DR_RECLAIMED]  = "DirectReclaimPages",
+    [HPA_DR_TOTAL_US]   = "DirectReclaimTotalUs",
+    [HPA_DR_MAX_US]     = "DirectReclaimMaxUs",
+};
+
+/*
+ * Sections of a node by occupancy: entirely free, partly free, with no
+ * free page at all and given back to the buddy allocator. Read without
+ * the section locks.
+ */
+static void hpa_node_section_usage(int nid, unsigned long *nr_free,
+        unsigned long *nr_partial, unsigned long *nr_full,
+        unsigned long *nr_offline)
+{
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    struct hpa_section *section;
+    unsigned long pnum, free;
+
+    *nr_free = *nr_partial = *nr_full = *nr_offline = 0;
+    if (!hpa_section_array[nid])
+        return;
+    for (pnum = 0; pnum < node->node_max_sections; pnum++) {
+        section = &hpa_section_array[nid][pnum];
+        free = ACCESS_ONCE(section->nr_free);
+        if (ACCESS_ONCE(section->state) & HPA_SECTION_OFFLINE)
+            (*nr_offline)++;
+        else if (!free)
+            (*nr_full)++;
+        else if (free >= section->nr_pages)
+            (*nr_free)++;
+        else
+            (*nr_partial)++;
+    }
+}
+
+static unsigned long hpa_node_pcp_pages(struct hpa_node *node)
+{
+    unsigned long nr = 0;
+    int cpu;
+
+    if (node->pcp)
+        for_each_online_cpu(cpu)
+            nr += ACCESS_ONCE(per_cpu_ptr(node->pcp, cpu)->count);
+    return nr;
+}
+
+/* the node's part of /proc/hpainfo, also the whole of its sysfs hpainfo */
+static int hpa_node_info_print(int nid, char *buf, size_t size)
+{
+    struct hpa_node *node = HPA_NODE_DATA(nid);
+    unsigned long sec_free, sec_partial, sec_full, sec_offline;
+    int i, n;
+
+    hpa_node_section_usage(nid, &sec_free, &sec_partial, &sec_full,
+                           &sec_offline);
+    n = scnprintf(buf, size,
+            "Node %d HpaTotal:       %8lu\n"
+            "Node %d HpaFree:        %8lu\n"
+            "Node %d HpaPcp:         %8lu\n"
+            "Node %d HpaZeroed:      %8lu\n"
+            "Node %d HpaActive:      %8lu\n"
+            "Node %d HpaInactive:    %8lu\n"
+            "Node %d HpaWatermark:   %8lu\n"
+            "Node %d HpaWatermarkHigh: %6lu\n"
+            "Node %d SectionsFree:   %8lu\n"
+            "Node %d SectionsPartial: %7lu\n"
+            "Node %d SectionsFull:   %8lu\n"
+            "Node %d SectionsOffline: %7lu\n",
+            nid, node->node_present_pages,
+            nid, hpa_node_page_state_snapshot(node, NR_FREE_PAGES),
+            nid, hpa_node_pcp_pages(node),
+            nid, ACCESS_ONCE(node->nr_zeroed),
+            nid, hpa_node_page_state_snapshot(node, NR_ACTIVE_FILE),
+            nid, hpa_node_page_state_snapshot(node, NR_INACTIVE_FILE),
+            nid, node->watermark,
+            nid, node->watermark_high,
+            nid, sec_free,
+            nid, sec_partial,
+            nid, sec_full,
+            nid, sec_offline);
+    for (i = 0; i < NR_HPA_EVENT_ITEMS; i++)
+        n += scnprintf(buf + n, size - n, "Node %d %s: %lu\n",
+                       nid, hpa_event_text[i], hpa_node_events(node, i));
+    return n;
+}
+
+static int hpainfo_proc_show(struct seq_file *m, void *v)
+{
+    unsigned long pnum;
+    size_t size;
+    char *buf;
+    int nid, i, n;
+
+    seq_printf(m, "HpaTotal:       %8lu\n"
+                  "HpaFree:        %8lu\n",
+               total_page, hpa_nr_free_pages());
+    for (i = 0; i < NR_HPA_DR_STAT; i++)
+        seq_printf(m, "%s: %ld\n", hpa_dr_stat_text[i],
+                   atomic_long_read(&hpa_dr_stat[i]));
+
+    for_each_huge_node(nid, HPNODE_MASK) {
+        size = seq_get_buf(m, &buf);
+        n = hpa_node_info_print(nid, buf, size);
+        /* a full buffer may be truncated, have seq_file retry bigger */
+        seq_commit(m, n < (int)size - 1 ? n : -1);
+
+        /* free pages left in every section, in section order */
+        seq_printf(m, "Node %d SectionFreePages:", nid);
+        for (pnum = 0; hpa_section_array[nid] &&
+                       pnum < HPA_NODE_DATA(nid)->node_max_sections; pnum++)
+            seq_printf(m, " %lu", ACCESS_ONCE(hpa_section_array[nid][pnum].nr_free));
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+
+static int hpainfo_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hpainfo_proc_show, NULL);
+}
+
+static const struct file_operations hpainfo_proc_fops = {
+    .open       = hpainfo_proc_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+/*
+ * Two clock reads and a per-cpu increment per call, cheap next to a 2MB
+ * allocation or clear, so on by default.
+ */
+bool hpa_lat_enabled = true;
+module_param_named(latency_hist, hpa_lat_enabled, bool, 0644);
+
+static DEFINE_PER_CPU(unsigned long [NR_HPA_LAT_ITEMS][HPA_LAT_BUCKETS], hpa_lat_hist);
+
+static const char * const hpa_lat_text[NR_HPA_LAT_ITEMS] = {
+    [HPA_LAT_ALLOC]         = "alloc_latency",
+    [HPA_LAT_FREE]          = "free_latency",
+    [HPA_LAT_LOCK_WAIT]     = "lock_wait_latency",
+    [HPA_LAT_UNMAP]         = "unmap_latency",
+    [HPA_LAT_REFERENCED]    = "referenced_latency",
+    [HPA_LAT_CLEAR]         = "clear_latency",
+};
+
+/* record the time since start, returning it in ns for the tracepoints */
+u64 hpa_lat_account(enum hpa_lat_item item, u64 start)
+{
+    u64 ns;
+    int b;
+
+    if (!start)
+        return 0;
+    ns = local_clock() - start;
+    b = min(fls64(ns), HPA_LAT_BUCKETS - 1);
+    this_cpu_inc(hpa_lat_hist[item][b]);
+    return ns;
+}
+EXPORT_SYMBOL(hpa_lat_account);
+
+static int hpa_lat_show(struct seq_file *m, void *v)
+{
+    enum hpa_lat_item item = (long)m->private;
+    unsigned long count, total = 0;
+    int cpu, b;
+
+    for (b = 0; b < HPA_LAT_BUCKETS; b++) {
+        count = 0;
+        for_each_possible_cpu(cpu)
+            count += per_cpu(hpa_lat_hist, cpu)[item][b];
+        total += count;
+        if (!count)
+            continue;
+        if (b == HPA_LAT_BUCKETS - 1)
+            seq_printf(m, "%12llu -          ns: %lu\n", 1ULL << (b - 1), count);
+        else
+            seq_printf(m, "%12llu - %-10llu ns: %lu\n",
+                       b ? 1ULL << (b - 1) : 0ULL, (1ULL << b) - 1, count);
+    }
+    seq_printf(m, "total: %lu\n", total);
+    return 0;
+}
+
+static int hpa_lat_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hpa_lat_show, inode->i_private);
+}
+
+static const struct file_operations hpa_lat_fops = {
+    .open       = hpa_lat_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+/*
+ * Node stress for cache line contention, see hpa_c2c_bench.sh. Writing n
+ * to /sys/kernel/debug/hpa/node_stress has every online cpu of the local
+ * node allocate, lock, unlock and free a page n times at once, which hits
+ * lru_lock, the counters, the watermarks and the section selection of one
+ * hpa_node from all of them. Reading gives the last run's time.
+ */
+struct hpa_stress_work {
+    struct work_struct work;
+    int nid;
+    unsigned long loops;
+};
+
+static DEFINE_MUTEX(hpa_stress_mutex);
+static unsigned long hpa_stress_loops;
+static int hpa_stress_cpus;
+static u64 hpa_stress_ns;
+
+static void hpa_stress_work_fn(struct work_struct *work)
+{
+    struct hpa_stress_work *sw = container_of(work, struct hpa_stress_work, work);
+    struct hugepage *page;
+    unsigned long i;
+
+    for (i = 0; i < sw->loops; i++) {
+        page = hpa_alloc_page_node(sw->nid);
+        if (!page)
+            break;
+        hpa_lock_page(page);
+        hpa_unlock_page(page);
+        hpa_put_page(page);
+        cond_resched();
+    }
+}
+
+static ssize_t hpa_stress_write(struct file *file, const char __user *ubuf,
+                                size_t count, loff_t *ppos)
+{
+    struct hpa_stress_work *works;
+    unsigned long loops;
+    int nid = numa_node_id(), cpu, nr = 0, i;
+    u64 start;
+    int ret;
+
+    ret = kstrtoul_from_user(ubuf, count, 0, &loops);
+    if (ret)
+        return ret;
+    if (!is_hpa_node(nid))
+        return -ENODEV;
+    works = kcalloc(nr_cpu_ids, sizeof(*works), GFP_KERNEL);
+    if (!works)
+        return -ENOMEM;
+
+    mutex_lock(&hpa_stress_mutex);
+    get_online_cpus();
+    start = local_clock();
+    for_each_cpu_and(cpu, cpumask_of_node(nid), cpu_online_mask) {
+        INIT_WORK(&works[nr].work, hpa_stress_work_fn);
+        works[nr].nid = nid;
+        works[nr].loops = loops;
+        queue_work_on(cpu, system_wq, &works[nr].work);
+        nr++;
+    }
+    for (i = 0; i < nr; i++)
+        flush_work(&works[i].work);
+    hpa_stress_ns = local_clock() - start;
+    put_online_cpus();
+    hpa_stress_loops = loops;
+    hpa_stress_cpus = nr;
+    mutex_unlock(&hpa_stress_mutex);
+    kfree(works);
+    return count;
+}
+
+static int hpa_stress_show(struct seq_file *m, void *v)
+{
+    mutex_lock(&hpa_stress_mutex);
+    seq_printf(m, "cpus: %d loops: %lu time_ns: %llu\n",
+               hpa_stress_cpus, hpa_stress_loops, hpa_stress_ns);
+    mutex_unlock(&hpa_stress_mutex);
+    return 0;
+}
+
+static int hpa_stress_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hpa_stress_show, NULL);
+}
+
+static const struct file_operations hpa_stress_fops = {
+    .open       = hpa_stress_open,
+    .read       = seq_read,
+    .write      = hpa_stress_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static void __init hpa_lat_debugfs_init(void)
+{
+    struct dentry *dir;
+    long i;
+
+    dir = hpa_debugfs_root();
+    if (IS_ERR_OR_NULL(dir))
+        return;
+    for (i = 0; i < NR_HPA_LAT_ITEMS; i++)
+        debugfs_create_file(hpa_lat_text[i], S_IRUSR, dir, (void *)i,
+                            &hpa_lat_fops);
+    debugfs_create_file("node_stress", S_IRUSR | S_IWUSR, dir, NULL,
+                        &hpa_stress_fops);
+}
+
+static ssize_t hpa_node_read_info(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    int nid = dev->id;
+
+    if (!is_hpa_node(nid) || !HPA_NODE_DATA(nid))
+        return 0;
+    return hpa_node_info_print(nid, buf, PAGE_SIZE);
+}
+static DEVICE_ATTR(hpainfo, S_IRUGO, hpa_node_read_info, NULL);
+
+/* node devices are registered by topology_init, a subsys_initcall */
+static int __init hpa_vmstat_init(void)
+{
+    int nid;
+
+    proc_create("hpainfo", S_IRUGO, NULL, &hpainfo_proc_fops);
+    for_each_huge_node(nid, HPNODE_MASK) {
+        if (node_devices[nid] &&
+            device_create_file(&node_devices[nid]->dev, &dev_attr_hpainfo))
+            pr_err("hpa: cannot create hpainfo for node %d\n", nid);
+    }
+    hpa_lat_debugfs_init();
+    return 0;
+}
+module_init(hpa_vmstat_init);
@@ -4,6 +4,20 @@
 #include <linux/pagemap.h>
 #include <linux/hpa.h>
 #include <linux/hugetlb.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/cpu.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include "hpa_trace.h"
+
+#ifdef MODULE_PARAM_PREFIX
+#undef MODULE_PARAM_PREFIX
+#endif
+#define MODULE_PARAM_PREFIX "hpa."
 
 
 static void __hpa_put_page(struct hugepage *page)
@@ -21,22 +35,49 @@ void hpa_put_page(struct hugepage *page)
 	}
 }
 EXPORT_SYMBOL(hpa_put_page);
-static int sleep_on_page(void *word)
+/*
+ * Spin for up to lock_spin_us on a contended page lock before sleeping,
+ * 0 disables spinning.
+ */
+static unsigned int hpa_lock_spin_us;
+module_param_named(lock_spin_us, hpa_lock_spin_us, uint, 0644);
+
+static wait_queue_head_t *hpa_page_waitqueue(struct hugepage *page)
 {
-    io_schedule();
-    return 0;
+        struct hpa_node *node = HPA_NODE_DATA(hpa_page_to_nid(page));
+
+        return &node->wait_table[hash_ptr(page, node->wait_table_bits)];
 }
 
-static wait_queue_head_t *hpa_node_waitqueue(struct hugepage *page)
+/* are there waiters for page left in its hashed waitqueue, wq->lock held */
+static bool hpa_page_has_waiters_locked(wait_queue_head_t *wq, struct hugepage *page)
 {
-        struct hpa_node *node = HPA_NODE_DATA(hpa_page_to_nid(page));
+        wait_queue_t *curr;
 
-        return &node->waitq;
+        list_for_each_entry(curr, &wq->task_list, task_list) {
+                struct wait_bit_queue *wbq = container_of(curr, struct wait_bit_queue, wait);
+
+                if (wbq->key.flags == &page->flags)
+                        return true;
+        }
+        return false;
 }
 
-static inline void hpa_wake_up_page(struct hugepage *page, int bit)
+/*
+ * Wake one waiter for bit of page. The waiters flag is dropped once no
+ * waiter of this page is left, so later unlocks skip the waitqueue.
+ */
+static void hpa_wake_up_page(struct hugepage *page, int bit)
 {
-        __wake_up_bit(hpa_node_waitqueue(page), &page->flags, bit);
+        wait_queue_head_t *wq = hpa_page_waitqueue(page);
+        struct wait_bit_key key = __WAIT_BIT_KEY_INITIALIZER(&page->flags, bit);
+        unsigned long flags;
+
+        spin_lock_irqsave(&wq->lock, flags);
+        __wake_up_locked_key(wq, TASK_NORMAL, &key);
+        if (!hpa_page_has_waiters_locked(wq, page))
+                ClearHpaPageWaiters(page);
+        spin_unlock_irqrestore(&wq->lock, flags);
 }
 
 void hpa_unlock_page(struct hugepage *page)
@@ -44,24 +85,159 @@ void hpa_unlock_page(struct hugepage *page)
 	//VM_BUG_ON(!PageLocked(hpa));
 	clear_bit_unlock(PG_locked, &page->flags);
 	smp_mb__after_clear_bit();
-	hpa_wake_up_page(page, PG_locked);
+	if (HpaPageWaiters(page))
+		hpa_wake_up_page(page, PG_locked);
 }
 EXPORT_SYMBOL(hpa_unlock_page);
 
+static bool hpa_lock_page_spin(struct hugepage *page)
+{
+	unsigned int spin_us = ACCESS_ONCE(hpa_lock_spin_us);
+	u64 deadline;
+
+	if (!spin_us)
+		return false;
+
+	deadline = local_clock() + (u64)spin_us * NSEC_PER_USEC;
+	do {
+		if (!test_bit(PG_locked, &page->flags) && hpa_trylock_page(page))
+			return true;
+		cpu_relax();
+	} while (!need_resched() && local_clock() < deadline);
+	return false;
+}
+
 void __hpa_lock_page(struct hugepage *page)
 {
+	wait_queue_head_t *wq = hpa_page_waitqueue(page);
 	DEFINE_WAIT_BIT(wait, &page->flags, PG_locked);
-
-	__wait_on_bit_lock(hpa_node_waitqueue(page), &wait, sleep_on_page,
-							TASK_UNINTERRUPTIBLE);
+	u64 start = hpa_lat_start();
+
+	if (hpa_lock_page_spin(page))
+		goto out;
+
+	do {
+		prepare_to_wait_exclusive(wq, &wait.wait, TASK_UNINTERRUPTIBLE);
+		/* pairs with the barrier between unlock and the waiters test */
+		SetHpaPageWaiters(page);
+		smp_mb();
+		if (test_bit(PG_locked, &page->flags))
+			io_schedule();
+	} while (!hpa_trylock_page(page));
+	finish_wait(wq, &wait.wait);
+out:
+	trace_hpa_lock_page_wait(page, hpa_lat_account(HPA_LAT_LOCK_WAIT, start));
 }
 EXPORT_SYMBOL(__hpa_lock_page);
 
+/*
+ * Lockless page cache lookup: the reference is taken speculatively under
+ * rcu and the slot rechecked, so a racing __hpa_delete_from_page_cache or
+ * a free and reuse of the page is seen and the lookup retried. struct
+ * hugepage itself is never freed, only recycled.
+ */
+struct hugepage *hpa_find_get_page(struct address_space *mapping, pgoff_t offset)
+{
+    void **pagep;
+    struct hugepage *page;
+
+    rcu_read_lock();
+repeat:
+    page = NULL;
+    pagep = radix_tree_lookup_slot(&mapping->page_tree, offset);
+    if (pagep) {
+        page = radix_tree_deref_slot(pagep);
+        if (unlikely(!page))
+            goto out;
+        if (radix_tree_exception(page)) {
+            if (radix_tree_deref_retry(page))
+                goto repeat;
+            goto out;
+        }
+        if (!page_cache_get_speculative((struct page*)page))
+            goto repeat;
+
+        /* has the page moved or been freed and reused meanwhile? */
+        if (unlikely(page != *pagep)) {
+            hpa_put_page(page);
+            goto repeat;
+        }
+    }
+out:
+    rcu_read_unlock();
+    return page;
+}
+EXPORT_SYMBOL(hpa_find_get_page);
+
+/*
+ * Gang lookup of up to nr_pages pages with index in [*start, end], taking
+ * a reference on each, in one tree walk. *start is moved past the last
+ * page returned so the caller can continue from there.
+ */
+unsigned hpa_find_get_pages_range(struct address_space *mapping, pgoff_t *start,
+                                  pgoff_t end, unsigned int nr_pages,
+                                  struct hugepage **pages)
+{
+    unsigned int i, ret, nr_found;
+
+    if (unlikely(!nr_pages))
+        return 0;
+
+    rcu_read_lock();
+restart:
+    nr_found = radix_tree_gang_lookup_slot(&mapping->page_tree,
+                                           (void ***)pages, NULL, *start, nr_pages);
+    ret = 0;
+    for (i = 0; i < nr_found; i++) {
+        struct hugepage *page;
+repeat:
+        page = radix_tree_deref_slot((void **)pages[i]);
+        if (unlikely(!page))
+            continue;
+        if (radix_tree_exception(page)) {
+            if (radix_tree_deref_retry(page)) {
+                WARN_ON(i);
+                goto restart;
+            }
+            continue;
+        }
+        if (!page_cache_get_speculative((struct page*)page))
+            goto repeat;
+
+        if (unlikely(page != *((void **)pages[i]))) {
+            hpa_put_page(page);
+            goto repeat;
+        }
+        if (page->index > end) {
+            hpa_put_page(page);
+            break;
+        }
+        pages[ret++] = page;
+    }
+
+    /* everything found was removed before we could get a reference */
+    if (unlikely(!ret && nr_found && i == nr_found))
+        goto restart;
+    rcu_read_unlock();
+
+    if (ret)
+        *start = pages[ret - 1]->index + 1;
+    return ret;
+}
+EXPORT_SYMBOL(hpa_find_get_pages_range);
+
+unsigned hpa_find_get_pages(struct address_space *mapping, pgoff_t start,
+                            unsigned int nr_pages, struct hugepage **pages)
+{
+    return hpa_find_get_pages_range(mapping, &start, (pgoff_t)-1, nr_pages, pages);
+}
+EXPORT_SYMBOL(hpa_find_get_pages);
+
 struct hugepage *hpa_find_lock_page(struct address_space *mapping, pgoff_t offset)
 {
     struct hugepage *page;
 repeat:
-    page = (struct hugepage*)find_get_page(mapping, offset);
+    page = hpa_find_get_page(mapping, offset);
     if (page && !radix_tree_exception(page)) {
         hpa_lock_page(page);
 
@@ -142,6 +318,66 @@ int hpa_add_to_page_cache(struct hugepage *page, struct address_space *mapping,
     return 0;
 }
 
+/*
+ * Insert pages[0..nr) at indices start..start+nr-1 with one radix tree
+ * preload, one tree_lock hold and one nrpages/i_blocks update for the whole
+ * run. Should the preloaded nodes run out part way, the run is resumed
+ * under a fresh preload. Inserted pages are left locked, as with
+ * hpa_add_to_page_cache. Returns how many pages were inserted from the
+ * front of the run, or a negative error if none were.
+ */
+int hpa_add_to_page_cache_range(struct address_space *mapping, pgoff_t start,
+        struct hugepage **pages, int nr)
+{
+    struct inode *inode = mapping->host;
+    struct hstate *h = hstate_inode(inode);
+    struct hugepage *page, *failed;
+    int i = 0, done, error = 0;
+
+    while (i < nr) {
+        error = radix_tree_preload(GFP_KERNEL & ~__GFP_HIGHMEM);
+        if (error)
+            break;
+
+        failed = NULL;
+        done = i;
+        spin_lock_irq(&mapping->tree_lock);
+        for (; i < nr; i++) {
+            page = pages[i];
+            __set_page_locked((struct page*)page);
+            get_page((struct page*)page);
+            page->mapping = mapping;
+            page->index = start + i;
+
+            error = radix_tree_insert(&mapping->page_tree, start + i, page);
+            if (unlikely(error)) {
+                page->mapping = NULL;
+                __clear_page_locked((struct page*)page);
+                failed = page;
+                break;
+            }
+            ClearPagePrivate((struct page*)page);
+        }
+        mapping->nrpages += i - done;
+        spin_unlock_irq(&mapping->tree_lock);
+        radix_tree_preload_end();
+
+        if (failed)
+            hpa_put_page(failed);
+        /* only running out of preloaded nodes is worth another round */
+        if (error != -ENOMEM || i == done)
+            break;
+    }
+
+    if (i) {
+        spin_lock(&inode->i_lock);
+        inode->i_blocks += blocks_per_huge_page(h) * i;
+        spin_unlock(&inode->i_lock);
+    }
+    return i ? i : error;
+}
+EXPORT_SYMBOL(hpa_add_to_page_cache_range);
+
 void __hpa_delete_from_page_cache(struct hugepage *page)
 {
     struct address_space *mapping = page->mapping;
@@ -174,16 +410,293 @@ void hpa_delete_from_page_cache(struct hugepage *page)
 }
 EXPORT_SYMBOL(hpa_delete_from_page_cache);
 
+/*
+ * Clearing strategies for hpa_clear_huge_page, selected by clear_mode:
+ * HPA_CLEAR_MEMSET is a single memset of the whole page, HPA_CLEAR_SUBPAGE
+ * clears a subpage at a time with resched points and the faulting subpage
+ * last so it stays cache hot, HPA_CLEAR_NOCACHE does the same but with
+ * non-temporal stores for every subpage except the faulting one.
+ */
+enum {
+    HPA_CLEAR_MEMSET,
+    HPA_CLEAR_SUBPAGE,
+    HPA_CLEAR_NOCACHE,
+};
+
+#ifdef CONFIG_X86_64
+static int hpa_clear_mode = HPA_CLEAR_NOCACHE;
+#else
+static int hpa_clear_mode = HPA_CLEAR_SUBPAGE;
+#endif
+module_param_named(clear_mode, hpa_clear_mode, int, 0644);
+
+/*
+ * Batches of at least clear_split_min pages are cleared by up to
+ * clear_max_threads cpus of the pages' node, see hpa_clear_huge_pages.
+ */
+static int hpa_clear_split_min = 64;
+static int hpa_clear_max_threads = 4;
+module_param_named(clear_split_min, hpa_clear_split_min, int, 0644);
+module_param_named(clear_max_threads, hpa_clear_max_threads, int, 0644);
+
+#ifdef CONFIG_X86_64
+/* movnti is part of SSE2, which every x86_64 cpu has */
+static void hpa_clear_page_nocache(void *addr)
+{
+    unsigned long *p = addr;
+    int i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(long); i += 4)
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)\n\t"
+                     : : "r" (p + i), "r" (0UL) : "memory");
+}
+#endif
+
+static inline void hpa_clear_subpage(void *addr, bool nocache)
+{
+#ifdef CONFIG_X86_64
+    if (nocache) {
+        hpa_clear_page_nocache(addr);
+        return;
+    }
+#endif
+    clear_page(addr);
+}
+
+static void __hpa_clear_huge_page(struct hugepage *page, unsigned long address,
+                                  int mode)
+{
+    void *addr = hpa_page_address(page);
+    int target = (address & (HUGEPAGE_SIZE - 1)) >> PAGE_SHIFT;
+    bool nocache = (mode == HPA_CLEAR_NOCACHE);
+    int i;
+
+    if (mode == HPA_CLEAR_MEMSET) {
+        cond_resched();
+        addr = hpa_kmap_atomic(page);
+        memset(addr,0,HUGEPAGE_SIZE);
+        hpa_kunmap_atomic(addr);
+        return;
+    }
+
+    for (i = 0; i < HUGEPAGE_SIZE / PAGE_SIZE; i++) {
+        if (i == target)
+            continue;
+        cond_resched();
+        hpa_clear_subpage(addr + i * PAGE_SIZE, nocache);
+    }
+    /* streaming stores must be visible before the page gets mapped */
+    if (nocache)
+        wmb();
+    cond_resched();
+    clear_page(addr + target * PAGE_SIZE);
+}
+
+/* clear the whole page bypassing the cache where possible, for hp_zerod */
+void hpa_zero_huge_page(struct hugepage *page)
+{
+    void *addr = hpa_page_address(page);
+    int i;
+
+    for (i = 0; i < HUGEPAGE_SIZE / PAGE_SIZE; i++) {
+        hpa_clear_subpage(addr + i * PAGE_SIZE, true);
+        cond_resched();
+    }
+    wmb();
+}
+
 void hpa_clear_huge_page(struct hugepage *page,
 		     unsigned long address)
 {
-    void *addr;
+    struct hpa_node *node = HPA_NODE_DATA(hpa_page_to_nid(page));
+	u64 start = hpa_lat_start();
+
+	if (TestClearHpaPageZeroed(page)) {
+		count_hpa_event(node, HPA_ZEROED_HIT);
+		trace_hpa_clear_huge_page(page, true,
+				hpa_lat_account(HPA_LAT_CLEAR, start));
+		return;
+	}
+	count_hpa_event(node, HPA_ZEROED_MISS);
+
 	might_sleep();
-	cond_resched();
-	addr = hpa_kmap_atomic(page);
-    memset(addr,0,HUGEPAGE_SIZE);
-    hpa_kunmap_atomic(addr);
+	__hpa_clear_huge_page(page, address, ACCESS_ONCE(hpa_clear_mode));
+	trace_hpa_clear_huge_page(page, false,
+			hpa_lat_account(HPA_LAT_CLEAR, start));
+}
+
+struct hpa_clear_work {
+    struct work_struct work;
+    struct hugepage **pages;
+    int nr;
+};
+
+static void hpa_clear_pages_range(struct hugepage **pages, int nr)
+{
+    int i;
+
+    for (i = 0; i < nr; i++)
+        hpa_clear_huge_page(pages[i], 0);
+}
+
+static void hpa_clear_work_fn(struct work_struct *work)
+{
+    struct hpa_clear_work *cw = container_of(work, struct hpa_clear_work, work);
+
+    hpa_clear_pages_range(cw->pages, cw->nr);
+}
+
+/*
+ * Clear nr freshly allocated pages, e.g. to populate a whole mapping. Large
+ * batches are split into chunks handed to other cpus of the first page's
+ * node; the calling cpu clears the first chunk and anything that could not
+ * be handed out.
+ */
+void hpa_clear_huge_pages(struct hugepage **pages, int nr)
+{
+    struct hpa_clear_work *works = NULL;
+    int split_min = max(ACCESS_ONCE(hpa_clear_split_min), 1);
+    int nr_workers, nr_queued = 0, chunk, done, cpu, this_cpu, i;
+
+    nr_workers = min(ACCESS_ONCE(hpa_clear_max_threads), DIV_ROUND_UP(nr, split_min));
+    if (nr_workers > 1)
+        works = kcalloc(nr_workers - 1, sizeof(*works), GFP_KERNEL);
+    if (!works) {
+        hpa_clear_pages_range(pages, nr);
+        return;
+    }
+
+    chunk = DIV_ROUND_UP(nr, nr_workers);
+    done = chunk;
+
+    get_online_cpus();
+    this_cpu = get_cpu();
+    for_each_cpu_and(cpu, cpumask_of_node(hpa_page_to_nid(pages[0])), cpu_online_mask) {
+        if (cpu == this_cpu)
+            continue;
+        if (nr_queued == nr_workers - 1 || done >= nr)
+            break;
+        INIT_WORK(&works[nr_queued].work, hpa_clear_work_fn);
+        works[nr_queued].pages = pages + done;
+        works[nr_queued].nr = min(chunk, nr - done);
+        queue_work_on(cpu, system_wq, &works[nr_queued].work);
+        done += works[nr_queued].nr;
+        nr_queued++;
+    }
+    put_cpu();
+
+    hpa_clear_pages_range(pages, min(chunk, nr));
+    if (done < nr)
+        hpa_clear_pages_range(pages + done, nr - done);
+
+    for (i = 0; i < nr_queued; i++)
+        flush_work(&works[i].work);
+    put_online_cpus();
+    kfree(works);
+}
+EXPORT_SYMBOL(hpa_clear_huge_pages);
+
+/*
+ * Clearing microbenchmark, to pick clear_mode on a given machine. Writing
+ * n to /sys/kernel/debug/hpa/clear_bench takes up to n free pages of the
+ * local node and clears each of them once per mode; reading gives the
+ * mean time per page of the last run. Free pages are used up meanwhile,
+ * so run it on an idle system.
+ */
+#define HPA_CLEAR_BENCH_MAX     256
+#define HPA_CLEAR_NR_MODES      (HPA_CLEAR_NOCACHE + 1)
+
+static const char * const hpa_clear_mode_text[HPA_CLEAR_NR_MODES] = {
+    [HPA_CLEAR_MEMSET]      = "memset",
+    [HPA_CLEAR_SUBPAGE]     = "subpage",
+    [HPA_CLEAR_NOCACHE]     = "nocache",
+};
+
+static DEFINE_MUTEX(hpa_clear_bench_mutex);
+static u64 hpa_clear_bench_ns[HPA_CLEAR_NR_MODES];
+static int hpa_clear_bench_pages;
+
+static int hpa_clear_bench_show(struct seq_file *m, void *v)
+{
+    int mode;
+
+    mutex_lock(&hpa_clear_bench_mutex);
+    seq_printf(m, "pages: %d\n", hpa_clear_bench_pages);
+    for (mode = 0; mode < HPA_CLEAR_NR_MODES && hpa_clear_bench_pages; mode++)
+        seq_printf(m, "%-8s %10llu ns/page %6llu MB/s\n", hpa_clear_mode_text[mode],
+                   div_u64(hpa_clear_bench_ns[mode], hpa_clear_bench_pages),
+                   div64_u64((u64)hpa_clear_bench_pages * HUGEPAGE_SIZE * NSEC_PER_SEC,
+                             max_t(u64, hpa_clear_bench_ns[mode], 1) << 20));
+    mutex_unlock(&hpa_clear_bench_mutex);
+    return 0;
+}
+
+static ssize_t hpa_clear_bench_write(struct file *file, const char __user *ubuf,
+                                     size_t count, loff_t *ppos)
+{
+    struct hugepage **pages;
+    unsigned int nr;
+    int mode, i, n = 0;
+    u64 start;
+    int ret;
+
+    ret = kstrtouint_from_user(ubuf, count, 0, &nr);
+    if (ret)
+        return ret;
+    nr = clamp(nr, 1U, (unsigned int)HPA_CLEAR_BENCH_MAX);
+    pages = kcalloc(nr, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+
+    mutex_lock(&hpa_clear_bench_mutex);
+    while (n < nr && (pages[n] = hpa_alloc_page_node(numa_node_id())))
+        n++;
+    if (!n) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (mode = 0; mode < HPA_CLEAR_NR_MODES; mode++) {
+        start = local_clock();
+        for (i = 0; i < n; i++)
+            __hpa_clear_huge_page(pages[i], 0, mode);
+        hpa_clear_bench_ns[mode] = local_clock() - start;
+    }
+    hpa_clear_bench_pages = n;
+    ret = count;
+    for (i = 0; i < n; i++)
+        hpa_put_page(pages[i]);
+out:
+    mutex_unlock(&hpa_clear_bench_mutex);
+    kfree(pages);
+    return ret;
+}
+
+static int hpa_clear_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hpa_clear_bench_show, NULL);
+}
+
+static const struct file_operations hpa_clear_bench_fops = {
+    .open       = hpa_clear_bench_open,
+    .read       = seq_read,
+    .write      = hpa_clear_bench_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static int __init hpa_clear_bench_init(void)
+{
+    struct dentry *dir = hpa_debugfs_root();
+
+    if (!IS_ERR_OR_NULL(dir))
+        debugfs_create_file("clear_bench", S_IRUSR | S_IWUSR, dir, NULL,
+                            &hpa_clear_bench_fops);
+    return 0;
 }
+late_initcall(hpa_clear_bench_init);
 
 void add_hpage_to_lruvec(struct hugepage *hpage,enum lru_list lru)
 {
@@ -214,3 +727,30 @@ void add_hpage_to_lruvec(struct hugepage *hpage,enum lru_list lru)
     preempt_enable();
 }
 EXPORT_SYMBOL(add_hpage_to_lruvec);
+
+/*
+ * Put nr pages of node nid from list onto lruvec->lists[lru] with one
+ * lru_lock hold and one counter update. list is left empty.
+ */
+void add_hpage_list_to_lruvec(struct list_head *list, int nid, int nr,
+                              enum lru_list lru)
+{
+    struct hpa_node *node = hpa_node_data[nid];
+    struct lruvec *lruvec = &node->lruvec;
+    struct hugepage *hpage;
+    unsigned long flags;
+    int active = (lru == LRU_ACTIVE_FILE ? 1 : 0);
+
+    spin_lock_irqsave(&node->lru_lock, flags);
+
+    list_for_each_entry(hpage, list, lru) {
+        SetPageLRU((struct page*)hpage);
+        if(active) SetPageActive((struct page*)hpage);
+    }
+    list_splice_init(list, &lruvec->lists[lru]);
+    node_page_state_add(-nr, node, NR_FREE_PAGES);
+    node_page_state_add(nr, node, NR_LRU_BASE+lru);
+
+    spin_unlock_irqrestore(&node->lru_lock, flags);
+}
+EXPORT_SYMBOL(add_hpage_list_to_lruvec);